@@ -0,0 +1,986 @@
+#pragma once
+
+#include "hash_map.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+// Thread-safe maps built on top of HashMap
+// ConcurrentHashMap routes every key to one of several independent HashMap shards, each behind its own
+// reader/writer lock, so threads working on different shards never wait for each other
+// ConcurrentHopscotchMap is the concurrent variant from the hopscotch paper: readers never lock and validate
+// what they read against per-segment version counters, writers displace entries under segment locks
+// SnapshotHashMap publishes whole immutable versions of a HashMap for read-mostly data
+
+namespace hash_map_detail {
+    inline constexpr size_t CACHE_LINE_SIZE = 64;
+    inline constexpr size_t DEFAULT_SHARD_COUNT = 64;
+
+    // The shard is chosen by the top bits of the HashMap hash mixed once more. Its own top bits would leave every key
+    // of a shard with the same top bits there, so they would share a fraction of its buckets
+    inline constexpr size_t SHARD_MULTIPLIER = static_cast<size_t>(0xD6E8FEB86659FD93ull);
+
+    // A trivially copyable object kept in relaxed atomic words, so it can be read while a writer replaces it.
+    // A torn read is possible, ConcurrentHopscotchMap readers detect and discard it through segment versions
+    template<class T>
+    class AtomicCell {
+        static_assert(std::is_trivially_copyable_v<T>, "Lock-free reads need trivially copyable keys and values");
+        static constexpr size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    public:
+        T Load() const {
+            uint64_t words[WORDS];
+            for (size_t i = 0; i < WORDS; ++i) {
+                words[i] = words_[i].load(std::memory_order_relaxed);
+            }
+            T object;
+            std::memcpy(static_cast<void *>(&object), words, sizeof(T));
+            return object;
+        }
+
+        void Store(const T &object) {
+            uint64_t words[WORDS] = {};
+            std::memcpy(words, static_cast<const void *>(&object), sizeof(T));
+            for (size_t i = 0; i < WORDS; ++i) {
+                words_[i].store(words[i], std::memory_order_relaxed);
+            }
+        }
+
+    private:
+        std::atomic<uint64_t> words_[WORDS];
+    };
+}
+
+// No iterators or references into the map are handed out, every operation locks its shard for its own duration
+// only. find() returns a copy of the value, visit() and update() run a function on it under the lock
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+        class Allocator = std::allocator<std::pair<const KeyType, ValueType>>, class Policy = TablePolicy<>>
+class ConcurrentHashMap {
+    using PairType = std::pair<const KeyType, ValueType>;
+    using MapType = HashMap<KeyType, ValueType, Hash, KeyEqual, Allocator, Policy>;
+
+    // Padded, so the locks of neighbouring shards never share a cache line
+    struct alignas(hash_map_detail::CACHE_LINE_SIZE) Shard {
+        Shard(const Hash &hash, const KeyEqual &key_equal, const Allocator &alloc) : map(hash, key_equal, alloc) {};
+
+        mutable std::shared_mutex mutex;
+        MapType map;
+    };
+public:
+    // shard_count is rounded up to a power of two
+    explicit ConcurrentHashMap(size_t shard_count = hash_map_detail::DEFAULT_SHARD_COUNT, const Hash &hash = Hash(),
+                               const KeyEqual &key_equal = KeyEqual(), const Allocator &alloc = Allocator())
+            : shard_shift_(hash_map_detail::SIZE_T_BITS - hash_map_detail::Log2(std::max<size_t>(shard_count, 1))) {
+        for (size_t i = 0; i < ShardCount(); ++i) {
+            shards_.push_back(std::make_unique<Shard>(hash, key_equal, alloc));
+        }
+    };
+
+    ConcurrentHashMap(const ConcurrentHashMap &other) = delete;
+
+    ConcurrentHashMap &operator=(const ConcurrentHashMap &other) = delete;
+
+    size_t size() const {  // not a snapshot: shards are counted one after another
+        size_t size = 0;
+        for (size_t i = 0; i < ShardCount(); ++i) {
+            std::shared_lock lock(shards_[i]->mutex);
+            size += shards_[i]->map.size();
+        }
+        return size;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    size_t shard_count() const {
+        return ShardCount();
+    }
+
+    void reserve(size_t count) {  // keys spread evenly, so every shard reserves its share
+        for (size_t i = 0; i < ShardCount(); ++i) {
+            std::unique_lock lock(shards_[i]->mutex);
+            shards_[i]->map.reserve(count / ShardCount() + 1);
+        }
+    }
+
+    void clear() {
+        for (size_t i = 0; i < ShardCount(); ++i) {
+            std::unique_lock lock(shards_[i]->mutex);
+            shards_[i]->map.clear();
+        }
+    }
+
+    bool contains(const KeyType &key) const {
+        size_t hash = GetHash(key);
+        const Shard &shard = GetShard(hash);
+        std::shared_lock lock(shard.mutex);
+        return shard.map.FindKey(key, hash) != shard.map.end();
+    }
+
+    std::optional<ValueType> find(const KeyType &key) const {
+        size_t hash = GetHash(key);
+        const Shard &shard = GetShard(hash);
+        std::shared_lock lock(shard.mutex);
+        auto it = shard.map.FindKey(key, hash);
+        if (it == shard.map.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    // Runs f(const ValueType &) under the shared lock of the shard, returns false if the key is absent
+    template<class F>
+    bool visit(const KeyType &key, F &&f) const {
+        size_t hash = GetHash(key);
+        const Shard &shard = GetShard(hash);
+        std::shared_lock lock(shard.mutex);
+        auto it = shard.map.FindKey(key, hash);
+        if (it == shard.map.end()) {
+            return false;
+        }
+        f(static_cast<const ValueType &>(it->second));
+        return true;
+    }
+
+    // Runs f(ValueType &) under the exclusive lock of the shard, returns false if the key is absent
+    template<class F>
+    bool update(const KeyType &key, F &&f) {
+        size_t hash = GetHash(key);
+        Shard &shard = GetShard(hash);
+        std::unique_lock lock(shard.mutex);
+        auto it = shard.map.FindKey(key, hash);
+        if (it == shard.map.end()) {
+            return false;
+        }
+        f(it->second);
+        return true;
+    }
+
+    // Inserts ValueType(args...) if the key is absent, then runs f(ValueType &) on the stored value,
+    // all under one lock. Returns true if the pair was inserted
+    template<class F, class... Args>
+    bool upsert(const KeyType &key, F &&f, Args &&... args) {
+        size_t hash = GetHash(key);
+        Shard &shard = GetShard(hash);
+        std::unique_lock lock(shard.mutex);
+        auto [it, inserted] = TryEmplace(shard, key, hash, std::forward<Args>(args)...);
+        f(it->second);
+        return inserted;
+    }
+
+    bool insert(const PairType &pair) {
+        size_t hash = GetHash(pair.first);
+        Shard &shard = GetShard(hash);
+        std::unique_lock lock(shard.mutex);
+        return shard.map.FindOrInsertHashed(pair.first, hash, pair).second;
+    }
+
+    bool insert(PairType &&pair) {
+        size_t hash = GetHash(pair.first);
+        Shard &shard = GetShard(hash);
+        std::unique_lock lock(shard.mutex);
+        return shard.map.FindOrInsertHashed(pair.first, hash, std::move(pair)).second;
+    }
+
+    template<class... Args>
+    bool try_emplace(const KeyType &key, Args &&... args) {
+        size_t hash = GetHash(key);
+        Shard &shard = GetShard(hash);
+        std::unique_lock lock(shard.mutex);
+        return TryEmplace(shard, key, hash, std::forward<Args>(args)...).second;
+    }
+
+    template<class M>
+    bool insert_or_assign(const KeyType &key, M &&obj) {
+        size_t hash = GetHash(key);
+        Shard &shard = GetShard(hash);
+        std::unique_lock lock(shard.mutex);
+        auto [it, inserted] = TryEmplace(shard, key, hash, std::forward<M>(obj));
+        if (!inserted) {
+            it->second = std::forward<M>(obj);
+        }
+        return inserted;
+    }
+
+    size_t erase(const KeyType &key) {
+        size_t hash = GetHash(key);
+        Shard &shard = GetShard(hash);
+        std::unique_lock lock(shard.mutex);
+        return shard.map.EraseKey(key, hash);
+    }
+
+    // Runs f(const PairType &) on every pair, locking one shard at a time. f must not call back into the map
+    template<class F>
+    void for_each(F &&f) const {
+        for (size_t i = 0; i < ShardCount(); ++i) {
+            std::shared_lock lock(shards_[i]->mutex);
+            for (const auto &pair : shards_[i]->map) {
+                f(pair);
+            }
+        }
+    }
+
+private:
+    size_t ShardCount() const {
+        return size_t(1) << (hash_map_detail::SIZE_T_BITS - shard_shift_);
+    }
+
+    // The hash HashMap computes for the key, so the shard does not have to call the hash function again.
+    // Every shard hashes alike and none is ever assigned, so the first one computes it without a lock
+    size_t GetHash(const KeyType &key) const {
+        return shards_[0]->map.HashOf(key);
+    }
+
+    size_t ShardIndex(size_t hash) const {
+        if (shard_shift_ == hash_map_detail::SIZE_T_BITS) {  // a single shard, shifting by the full width is undefined
+            return 0;
+        }
+        return (hash * hash_map_detail::SHARD_MULTIPLIER) >> shard_shift_;
+    }
+
+    Shard &GetShard(size_t hash) {
+        return *shards_[ShardIndex(hash)];
+    }
+
+    const Shard &GetShard(size_t hash) const {
+        return *shards_[ShardIndex(hash)];
+    }
+
+    template<class... Args>
+    static auto TryEmplace(Shard &shard, const KeyType &key, size_t hash, Args &&... args) {
+        return shard.map.FindOrInsertHashed(key, hash, std::piecewise_construct, std::forward_as_tuple(key),
+                                            std::forward_as_tuple(std::forward<Args>(args)...));
+    }
+
+    size_t shard_shift_;
+    std::vector<std::unique_ptr<Shard>> shards_;  // never changes after construction
+};
+
+// Lookups take no lock and write no shared memory: a reader notes the version of the segment of the home bucket,
+// probes the neighbourhood and accepts the result only if the version is still the same and even. A writer locks
+// the segment of the home bucket and the next one (every bucket it may touch lies in them), makes the version odd
+// while it changes anything and even again afterwards. Keys and values must be trivially copyable and default
+// constructible, and KeyEqual must cope with a torn key.
+// Pairs that find no free bucket in reach go to a small open addressing stash. Writers change it under a mutex,
+// lookups probe it only while it is not empty, without locking, and validate what they read against its own version.
+// Every resize places the stashed pairs into the larger table, so the stash stays empty unless keys collide badly.
+// Growing does not stop the map: a doubled table is attached to the current one and every writer first claims
+// and migrates one segment of homes, then the segment of its own key, and writes to the new table. A migrated
+// segment is left with an odd version and a moved mark, readers that see it go on to the new table. The last
+// migrated segment publishes the new table. Replaced tables are kept until the map is destroyed, since a reader
+// may still be probing them; together they are smaller than the live table
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+        class Policy = TablePolicy<>>
+class ConcurrentHopscotchMap {
+    using HopInfoType = typename Policy::HopInfoType;
+    static constexpr size_t NEXT = Policy::NEXT;
+    static constexpr size_t SEGMENT_SIZE = 512;  // buckets guarded by one lock and version counter
+    static constexpr size_t ADD_RANGE = SEGMENT_SIZE;  // how far past its home bucket an insertion looks for a free bucket
+    static constexpr size_t STASH_INITIAL_SIZE = 16;
+    static_assert(NEXT <= ADD_RANGE, "The neighbourhood has to fit into the insertion range");
+
+    struct Bucket {
+        std::atomic<HopInfoType> hop_info;
+        bool occupied;  // only accessed by writers holding the segment of the bucket
+        hash_map_detail::AtomicCell<KeyType> key;
+        hash_map_detail::AtomicCell<ValueType> value;
+    };
+
+    struct alignas(hash_map_detail::CACHE_LINE_SIZE) Segment {
+        std::mutex mutex;
+        std::atomic<uint64_t> version;
+        std::atomic<bool> moved;  // the pairs of its homes live in the next table, set under the lock
+    };
+
+    struct StashSlot {
+        std::atomic<bool> used;
+        size_t hash;  // only accessed by writers holding the stash mutex
+        hash_map_detail::AtomicCell<KeyType> key;
+        hash_map_detail::AtomicCell<ValueType> value;
+    };
+
+    struct Stash {  // linear probing, never more than half full
+        explicit Stash(size_t capacity)
+                : shift(hash_map_detail::SIZE_T_BITS - hash_map_detail::Log2(capacity)), capacity(capacity),
+                  slots(new StashSlot[capacity]()) {};
+
+        // The hash is mixed once more, since stashed keys tend to share the top bits that chose their home
+        size_t Index(size_t hash) const {
+            return (hash * hash_map_detail::SHARD_MULTIPLIER) >> shift;
+        }
+
+        size_t shift;
+        size_t capacity;
+        std::unique_ptr<StashSlot[]> slots;
+    };
+
+    struct Table {
+        explicit Table(size_t bucket_count)
+                : shift(hash_map_detail::SIZE_T_BITS - std::max<size_t>(hash_map_detail::Log2(bucket_count), 1)),
+                  size((size_t(1) << (hash_map_detail::SIZE_T_BITS - shift)) + ADD_RANGE),
+                  segment_count((size + SEGMENT_SIZE - 1) / SEGMENT_SIZE), buckets(new Bucket[size]()),
+                  segments(new Segment[segment_count]()) {};
+
+        size_t BucketCount() const {
+            return size - ADD_RANGE;
+        }
+
+        size_t HomeSegments() const {  // the segments that hold home buckets, the rest is the tail
+            return (BucketCount() + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+        }
+
+        size_t shift;
+        size_t size;
+        size_t segment_count;
+        std::unique_ptr<Bucket[]> buckets;
+        std::unique_ptr<Segment[]> segments;
+        std::atomic<Table *> next{nullptr};  // the table being grown into, owned by the map
+        std::atomic<size_t> claimed{0};  // segments handed out for migration
+        std::atomic<size_t> migrated{0};
+    };
+
+    // Locks the segment of home and the next one in this order, any two writers of a common bucket share a segment
+    class SegmentLock {
+    public:
+        SegmentLock(Table &table, size_t home)
+                : table_(table), first_(home / SEGMENT_SIZE), last_(std::min(first_ + 1, table.segment_count - 1)) {
+            for (size_t i = first_; i <= last_; ++i) {
+                table_.segments[i].mutex.lock();
+            }
+        }
+
+        SegmentLock(const SegmentLock &other) = delete;
+
+        SegmentLock &operator=(const SegmentLock &other) = delete;
+
+        // Readers of both segments retry until the lock is released. A moved segment keeps its odd version,
+        // its buckets may still be written by the neighbour segment but nobody reads them any more
+        void BeginWrite() {
+            if (!writing_) {
+                writing_ = true;
+                BumpVersions(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+            }
+        }
+
+        ~SegmentLock() {
+            if (writing_) {
+                BumpVersions(std::memory_order_release);
+            }
+            for (size_t i = last_ + 1; i-- > first_;) {
+                table_.segments[i].mutex.unlock();
+            }
+        }
+
+    private:
+        void BumpVersions(std::memory_order order) {
+            for (size_t i = first_; i <= last_; ++i) {
+                Segment &segment = table_.segments[i];
+                if (!segment.moved.load(std::memory_order_relaxed)) {
+                    segment.version.store(segment.version.load(std::memory_order_relaxed) + 1, order);
+                }
+            }
+        }
+
+        Table &table_;
+        size_t first_;
+        size_t last_;
+        bool writing_ = false;
+    };
+
+public:
+    explicit ConcurrentHopscotchMap(size_t bucket_count = Policy::INITIAL_SIZE, const Hash &hash = Hash(),
+                                    const KeyEqual &key_equal = KeyEqual())
+            : current_(std::make_unique<Table>(std::max(bucket_count, Policy::INITIAL_SIZE))), table_(current_.get()),
+              stash_(std::make_unique<Stash>(STASH_INITIAL_SIZE)), stash_table_(stash_.get()), stash_version_(0),
+              stash_size_(0), pairs_count_(0), hash_func_(hash), key_equal_(key_equal) {};
+
+    ConcurrentHopscotchMap(const ConcurrentHopscotchMap &other) = delete;
+
+    ConcurrentHopscotchMap &operator=(const ConcurrentHopscotchMap &other) = delete;
+
+    size_t size() const {
+        return pairs_count_.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    size_t bucket_count() const {
+        return table_.load(std::memory_order_acquire)->BucketCount();
+    }
+
+    std::optional<ValueType> find(const KeyType &key) const {
+        size_t hash = GetHash(key);
+        const Table *table = table_.load(std::memory_order_acquire);
+        for (;;) {
+            size_t home = hash >> table->shift;
+            const Segment &segment = table->segments[home / SEGMENT_SIZE];
+            uint64_t before = segment.version.load(std::memory_order_acquire);
+            if (before & 1) {
+                if (segment.moved.load(std::memory_order_acquire)) {
+                    table = table->next.load(std::memory_order_acquire);
+                } else {  // a writer is busy with the segment
+                    std::this_thread::yield();
+                }
+                continue;
+            }
+            std::optional<ValueType> result;
+            for (auto hop_info = table->buckets[home].hop_info.load(std::memory_order_relaxed); hop_info; hop_info &= hop_info - 1) {
+                const Bucket &bucket = table->buckets[home + hash_map_detail::LowestBit(hop_info)];
+                if (key_equal_(bucket.key.Load(), key)) {
+                    result = bucket.value.Load();
+                    break;
+                }
+            }
+            // still inside the validated window: a pair moved from the stash into the table changes the version
+            if (!result && stash_size_.load(std::memory_order_acquire) != 0 && !StashLoad(key, hash, result)) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (segment.version.load(std::memory_order_relaxed) == before) {
+                return result;
+            }
+        }
+    }
+
+    bool contains(const KeyType &key) const {
+        return find(key).has_value();
+    }
+
+    bool insert(const KeyType &key, const ValueType &value) {  // false if the key is present, its value is kept
+        return Insert(key, value, false);
+    }
+
+    bool insert_or_assign(const KeyType &key, const ValueType &value) {  // true if the key was absent
+        return Insert(key, value, true);
+    }
+
+    size_t erase(const KeyType &key) {
+        size_t hash = GetHash(key);
+        for (;;) {
+            Table *table = WritableTable(hash);
+            size_t home = hash >> table->shift;
+            SegmentLock lock(*table, home);
+            if (table->segments[home / SEGMENT_SIZE].moved.load(std::memory_order_relaxed)) {
+                continue;  // migrated while waiting for the lock
+            }
+            size_t index = FindLocked(*table, home, key);
+            if (index != table->size) {
+                lock.BeginWrite();
+                table->buckets[index].occupied = false;
+                ResetHop(*table, home, index - home);
+            } else if (stash_size_.load(std::memory_order_relaxed) == 0 || !StashErase(key, hash)) {
+                return 0;
+            }
+            pairs_count_.fetch_sub(1, std::memory_order_relaxed);
+            return 1;
+        }
+    }
+
+private:
+    size_t GetHash(const KeyType &key) const {
+        return hash_func_(key) * hash_map_detail::FIBONACCI_MULTIPLIER;
+    }
+
+    bool Insert(const KeyType &key, const ValueType &value, bool assign) {
+        size_t hash = GetHash(key);
+        for (;;) {
+            Table *table = WritableTable(hash);
+            if (pairs_count_.load(std::memory_order_relaxed) >= table->BucketCount() * Policy::MAX_LOAD_FACTOR) {
+                Grow(table);
+                continue;
+            }
+            size_t home = hash >> table->shift;
+            SegmentLock lock(*table, home);
+            if (table->segments[home / SEGMENT_SIZE].moved.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            size_t index = FindLocked(*table, home, key);
+            if (index != table->size) {
+                if (assign) {
+                    lock.BeginWrite();
+                    table->buckets[index].value.Store(value);
+                }
+                return false;
+            }
+            if (stash_size_.load(std::memory_order_relaxed) != 0) {
+                std::lock_guard stash_lock(stash_mutex_);
+                if (StashSlot *slot = StashFindLocked(key, hash)) {
+                    if (assign) {
+                        BeginStashWrite();
+                        slot->value.Store(value);
+                        EndStashWrite();
+                    }
+                    return false;
+                }
+            }
+            lock.BeginWrite();
+            if (!Place(*table, home, key, value)) {
+                StashInsert(key, value, hash);
+            }
+            pairs_count_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    // The table writes of the key go to. While a resize is under way the writer helps with one segment
+    // and makes sure the segment of its key has been migrated, the key is then written to the new table
+    Table *WritableTable(size_t hash) {
+        Table *table = table_.load(std::memory_order_acquire);
+        Table *next = table->next.load(std::memory_order_acquire);
+        if (!next) {
+            return table;
+        }
+        size_t claimed = table->claimed.fetch_add(1, std::memory_order_relaxed);
+        if (claimed < table->HomeSegments()) {
+            MigrateSegment(*table, claimed);
+        }
+        MigrateSegment(*table, (hash >> table->shift) / SEGMENT_SIZE);
+        return next;
+    }
+
+    // Starts growing table unless that is under way. If table is itself the target of an unfinished resize,
+    // that resize is completed first, a table is never grown into a third one before it is published
+    void Grow(Table *table) {
+        Table *current = table_.load(std::memory_order_acquire);
+        if (current != table) {
+            if (current->next.load(std::memory_order_acquire) == table) {
+                for (size_t i = 0; i < current->HomeSegments(); ++i) {
+                    MigrateSegment(*current, i);
+                }
+                std::this_thread::yield();  // the thread that migrated the last segment may still be publishing
+            }
+            return;
+        }
+        std::lock_guard resize_lock(resize_mutex_);
+        if (table == table_.load(std::memory_order_relaxed) && !table->next.load(std::memory_order_relaxed)) {
+            next_ = std::make_unique<Table>(table->BucketCount() * 2);
+            table->next.store(next_.get(), std::memory_order_release);
+        }
+    }
+
+    // Copies the pairs with homes in the segment to the next table, they stay in the old buckets for readers
+    // that have not seen the moved mark yet. Locks of the old table are always taken before those of the new one
+    void MigrateSegment(Table &table, size_t segment_index) {
+        Segment &segment = table.segments[segment_index];
+        if (segment.moved.load(std::memory_order_acquire)) {
+            return;
+        }
+        Table &next = *table.next.load(std::memory_order_acquire);
+        {
+            SegmentLock lock(table, segment_index * SEGMENT_SIZE);
+            if (segment.moved.load(std::memory_order_relaxed)) {
+                return;
+            }
+            size_t end = std::min((segment_index + 1) * SEGMENT_SIZE, table.BucketCount());
+            for (size_t home = segment_index * SEGMENT_SIZE; home < end; ++home) {
+                for (auto hop_info = table.buckets[home].hop_info.load(std::memory_order_relaxed); hop_info; hop_info &= hop_info - 1) {
+                    const Bucket &bucket = table.buckets[home + hash_map_detail::LowestBit(hop_info)];
+                    KeyType key = bucket.key.Load();
+                    size_t hash = GetHash(key);
+                    size_t next_home = hash >> next.shift;
+                    SegmentLock next_lock(next, next_home);
+                    next_lock.BeginWrite();
+                    if (!Place(next, next_home, key, bucket.value.Load())) {
+                        StashInsert(key, bucket.value.Load(), hash);
+                    }
+                }
+            }
+            segment.moved.store(true, std::memory_order_relaxed);
+            segment.version.store(segment.version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+        if (table.migrated.fetch_add(1, std::memory_order_acq_rel) + 1 == table.HomeSegments()) {
+            DrainStash(next);
+            std::lock_guard resize_lock(resize_mutex_);
+            table_.store(&next, std::memory_order_release);
+            retired_.push_back(std::move(current_));
+            current_ = std::move(next_);
+        }
+    }
+
+    // Places the stashed pairs that fit into the grown table there, so lookups stop probing the stash.
+    // Each pair is placed under the segments of its home before it leaves the stash, as writers of its key do
+    void DrainStash(Table &table) {
+        std::vector<std::pair<KeyType, size_t>> keys;
+        {
+            std::lock_guard stash_lock(stash_mutex_);
+            for (size_t i = 0; i < stash_->capacity; ++i) {
+                const StashSlot &slot = stash_->slots[i];
+                if (slot.used.load(std::memory_order_relaxed)) {
+                    keys.emplace_back(slot.key.Load(), slot.hash);
+                }
+            }
+        }
+        for (const auto &[key, hash] : keys) {
+            size_t home = hash >> table.shift;
+            SegmentLock lock(table, home);
+            std::lock_guard stash_lock(stash_mutex_);
+            StashSlot *slot = StashFindLocked(key, hash);
+            if (!slot) {  // erased in the meantime
+                continue;
+            }
+            lock.BeginWrite();
+            if (Place(table, home, key, slot->value.Load())) {
+                StashRemoveLocked(slot);
+            }
+        }
+    }
+
+    size_t FindLocked(const Table &table, size_t home, const KeyType &key) const {
+        for (auto hop_info = table.buckets[home].hop_info.load(std::memory_order_relaxed); hop_info; hop_info &= hop_info - 1) {
+            size_t index = home + hash_map_detail::LowestBit(hop_info);
+            if (key_equal_(table.buckets[index].key.Load(), key)) {
+                return index;
+            }
+        }
+        return table.size;
+    }
+
+    // Looks for a free bucket in [home, home + ADD_RANGE) and moves it into the neighbourhood of home
+    // as BucketArray::PrepareInsert does. The caller holds the segments of that range
+    static bool Place(Table &table, size_t home, const KeyType &key, const ValueType &value) {
+        size_t free_bucket = home;
+        while (free_bucket < home + ADD_RANGE && table.buckets[free_bucket].occupied) {
+            ++free_bucket;
+        }
+        if (free_bucket == home + ADD_RANGE) {
+            return false;
+        }
+        while (home + NEXT <= free_bucket) {
+            if (!MoveCloser(table, free_bucket)) {
+                return false;
+            }
+        }
+        Bucket &bucket = table.buckets[free_bucket];
+        bucket.key.Store(key);
+        bucket.value.Store(value);
+        bucket.occupied = true;
+        SetHop(table, home, free_bucket - home);
+        return true;
+    }
+
+    // The moved entry is published at its new place before it leaves the old one
+    static bool MoveCloser(Table &table, size_t &free_bucket) {
+        for (size_t home = free_bucket - NEXT + 1; home < free_bucket; ++home) {
+            auto hop_info = table.buckets[home].hop_info.load(std::memory_order_relaxed);
+            if (hop_info) {
+                size_t offset = hash_map_detail::LowestBit(hop_info);
+                size_t from = home + offset;
+                if (from < free_bucket) {
+                    Bucket &target = table.buckets[free_bucket];
+                    target.key.Store(table.buckets[from].key.Load());
+                    target.value.Store(table.buckets[from].value.Load());
+                    target.occupied = true;
+                    SetHop(table, home, free_bucket - home);
+                    table.buckets[from].occupied = false;
+                    ResetHop(table, home, offset);
+                    free_bucket = from;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    static void SetHop(Table &table, size_t home, size_t offset) {
+        auto &hop_info = table.buckets[home].hop_info;
+        hop_info.store(hop_info.load(std::memory_order_relaxed) | (HopInfoType(1) << offset), std::memory_order_relaxed);
+    }
+
+    static void ResetHop(Table &table, size_t home, size_t offset) {
+        auto &hop_info = table.buckets[home].hop_info;
+        hop_info.store(hop_info.load(std::memory_order_relaxed) & ~(HopInfoType(1) << offset), std::memory_order_relaxed);
+    }
+
+    // Probes the stash as find() probes a neighbourhood. False if a writer changed it meanwhile, result is void then
+    bool StashLoad(const KeyType &key, size_t hash, std::optional<ValueType> &result) const {
+        uint64_t before = stash_version_.load(std::memory_order_acquire);
+        if (before & 1) {
+            return false;
+        }
+        const Stash &stash = *stash_table_.load(std::memory_order_acquire);
+        size_t index = stash.Index(hash);
+        for (size_t probe = 0; probe < stash.capacity; ++probe, index = (index + 1) & (stash.capacity - 1)) {
+            const StashSlot &slot = stash.slots[index];
+            if (!slot.used.load(std::memory_order_relaxed)) {
+                break;
+            }
+            if (key_equal_(slot.key.Load(), key)) {
+                result = slot.value.Load();
+                break;
+            }
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return stash_version_.load(std::memory_order_relaxed) == before;
+    }
+
+    // The functions below are called with stash_mutex_ held. Changes readers may see are made between
+    // BeginStashWrite() and EndStashWrite(), the stash version is odd in between as a segment version is
+    void BeginStashWrite() {
+        stash_version_.store(stash_version_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void EndStashWrite() {
+        stash_version_.store(stash_version_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    StashSlot *StashFindLocked(const KeyType &key, size_t hash) {
+        size_t mask = stash_->capacity - 1;
+        for (size_t index = stash_->Index(hash); stash_->slots[index].used.load(std::memory_order_relaxed);
+             index = (index + 1) & mask) {
+            StashSlot &slot = stash_->slots[index];
+            if (slot.hash == hash && key_equal_(slot.key.Load(), key)) {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    // A full stash is copied into one twice as large. Readers may still probe the old one, it is kept until
+    // the map is destroyed as replaced tables are. Together the old ones are smaller than the live stash
+    void StashInsertLocked(const KeyType &key, const ValueType &value, size_t hash) {
+        size_t count = stash_size_.load(std::memory_order_relaxed);
+        if ((count + 1) * 2 > stash_->capacity) {
+            auto stash = std::make_unique<Stash>(stash_->capacity * 2);
+            for (size_t i = 0; i < stash_->capacity; ++i) {
+                const StashSlot &slot = stash_->slots[i];
+                if (slot.used.load(std::memory_order_relaxed)) {
+                    StashPlace(*stash, slot.key.Load(), slot.value.Load(), slot.hash);
+                }
+            }
+            stash_table_.store(stash.get(), std::memory_order_release);
+            retired_stashes_.push_back(std::move(stash_));
+            stash_ = std::move(stash);
+        }
+        BeginStashWrite();
+        StashPlace(*stash_, key, value, hash);
+        EndStashWrite();
+        stash_size_.store(count + 1, std::memory_order_release);
+    }
+
+    static void StashPlace(Stash &stash, const KeyType &key, const ValueType &value, size_t hash) {
+        size_t index = stash.Index(hash);
+        while (stash.slots[index].used.load(std::memory_order_relaxed)) {
+            index = (index + 1) & (stash.capacity - 1);
+        }
+        StashSlot &slot = stash.slots[index];
+        slot.hash = hash;
+        slot.key.Store(key);
+        slot.value.Store(value);
+        slot.used.store(true, std::memory_order_relaxed);
+    }
+
+    // Later pairs of the probe run are shifted back into the hole, so probing still stops at the first free slot
+    void StashRemoveLocked(StashSlot *removed) {
+        size_t mask = stash_->capacity - 1;
+        size_t hole = removed - stash_->slots.get();
+        BeginStashWrite();
+        for (size_t index = (hole + 1) & mask; stash_->slots[index].used.load(std::memory_order_relaxed);
+             index = (index + 1) & mask) {
+            StashSlot &slot = stash_->slots[index];
+            if (((index - stash_->Index(slot.hash)) & mask) >= ((index - hole) & mask)) {
+                StashSlot &target = stash_->slots[hole];
+                target.hash = slot.hash;
+                target.key.Store(slot.key.Load());
+                target.value.Store(slot.value.Load());
+                hole = index;
+            }
+        }
+        stash_->slots[hole].used.store(false, std::memory_order_relaxed);
+        EndStashWrite();
+        stash_size_.store(stash_size_.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+    }
+
+    void StashInsert(const KeyType &key, const ValueType &value, size_t hash) {
+        std::lock_guard lock(stash_mutex_);
+        StashInsertLocked(key, value, hash);
+    }
+
+    bool StashErase(const KeyType &key, size_t hash) {
+        std::lock_guard lock(stash_mutex_);
+        StashSlot *slot = StashFindLocked(key, hash);
+        if (!slot) {
+            return false;
+        }
+        StashRemoveLocked(slot);
+        return true;
+    }
+
+    std::unique_ptr<Table> current_;  // owned here, readers follow table_
+    std::unique_ptr<Table> next_;  // the table being grown into, if any
+    std::atomic<Table *> table_;
+    std::vector<std::unique_ptr<Table>> retired_;
+    std::mutex resize_mutex_;
+    std::unique_ptr<Stash> stash_;  // owned here, readers follow stash_table_
+    std::atomic<Stash *> stash_table_;
+    std::vector<std::unique_ptr<Stash>> retired_stashes_;
+    std::atomic<uint64_t> stash_version_;
+    std::mutex stash_mutex_;
+    std::atomic<size_t> stash_size_;
+    std::atomic<size_t> pairs_count_;
+    Hash hash_func_;
+    KeyEqual key_equal_;
+};
+
+// A HashMap for read-mostly data. The writer changes a private copy and publishes it with one pointer store,
+// readers work on an immutable snapshot without locks. Old versions are reclaimed with epochs: a reader announces
+// the epoch it started in through its own cache line, and a version retired in an earlier epoch than every
+// announced one is freed on the next publish. Pinning a snapshot costs a store and a fence, no read-modify-write
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+        class Allocator = std::allocator<std::pair<const KeyType, ValueType>>, class Policy = TablePolicy<>>
+class SnapshotHashMap {
+    using MapType = HashMap<KeyType, ValueType, Hash, KeyEqual, Allocator, Policy>;
+
+    static constexpr uint64_t IDLE = ~uint64_t(0);
+
+    struct alignas(hash_map_detail::CACHE_LINE_SIZE) Slot {
+        std::atomic<uint64_t> epoch{IDLE};
+        size_t depth = 0;  // live snapshots of the reader, only its own thread touches it
+        bool in_use = true;  // guarded by the writer mutex
+    };
+
+public:
+    // Pins the version that was current when it was taken, it stays valid until the snapshot is destroyed.
+    // Snapshots of one reader nest: the epoch announced by the outermost one covers the later versions as well
+    class Snapshot {
+    public:
+        Snapshot(const Snapshot &other) = delete;
+
+        Snapshot &operator=(const Snapshot &other) = delete;
+
+        ~Snapshot() {
+            if (--slot_.depth == 0) {
+                slot_.epoch.store(IDLE, std::memory_order_release);
+            }
+        }
+
+        const MapType &operator*() const {
+            return *map_;
+        }
+
+        const MapType *operator->() const {
+            return map_;
+        }
+
+    private:
+        friend class SnapshotHashMap;
+
+        Snapshot(Slot &slot, const MapType *map) : slot_(slot), map_(map) {};
+
+        Slot &slot_;
+        const MapType *map_;
+    };
+
+    // A registered reader, meant to be created once per thread and kept. It has to outlive its snapshots
+    class Reader {
+    public:
+        Reader(const Reader &other) = delete;
+
+        Reader &operator=(const Reader &other) = delete;
+
+        ~Reader() {  // a slot still pinned by a snapshot is never handed to another reader
+            assert(slot_.depth == 0 && "Reader destroyed while its snapshots are alive");
+            std::lock_guard lock(owner_.writer_mutex_);
+            slot_.in_use = slot_.depth != 0;
+        }
+
+        Snapshot snapshot() const {
+            if (slot_.depth++ == 0) {
+                slot_.epoch.store(owner_.epoch_.load(std::memory_order_seq_cst), std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);  // the writer sees the epoch before the map is read
+            }
+            return Snapshot(slot_, owner_.current_.load(std::memory_order_seq_cst));
+        }
+
+        std::optional<ValueType> find(const KeyType &key) const {
+            Snapshot snapshot = this->snapshot();
+            auto it = snapshot->find(key);
+            if (it == snapshot->end()) {
+                return std::nullopt;
+            }
+            return it->second;
+        }
+
+        bool contains(const KeyType &key) const {
+            return snapshot()->contains(key);
+        }
+
+    private:
+        friend class SnapshotHashMap;
+
+        Reader(const SnapshotHashMap &owner, Slot &slot) : owner_(owner), slot_(slot) {};
+
+        const SnapshotHashMap &owner_;
+        Slot &slot_;
+    };
+
+    explicit SnapshotHashMap(MapType map = MapType())
+            : owned_(std::make_unique<MapType>(std::move(map))), current_(owned_.get()), epoch_(0) {};
+
+    SnapshotHashMap(const SnapshotHashMap &other) = delete;
+
+    SnapshotHashMap &operator=(const SnapshotHashMap &other) = delete;
+
+    Reader reader() const {
+        std::lock_guard lock(writer_mutex_);
+        for (Slot &slot : slots_) {
+            if (!slot.in_use) {
+                slot.in_use = true;
+                return Reader(*this, slot);
+            }
+        }
+        return Reader(*this, slots_.emplace_back());
+    }
+
+    // Runs f(MapType &) on a copy of the current version and publishes the result. Writers are serialized
+    template<class F>
+    void update(F &&f) {
+        std::lock_guard lock(writer_mutex_);
+        auto map = std::make_unique<MapType>(*owned_);
+        f(*map);
+        Publish(std::move(map));
+    }
+
+    void publish(MapType map) {  // replaces the contents wholesale, e.g. with a freshly built table
+        std::lock_guard lock(writer_mutex_);
+        Publish(std::make_unique<MapType>(std::move(map)));
+    }
+
+private:
+    // Readers that announce a later epoch than the one old is retired in are guaranteed to see map
+    void Publish(std::unique_ptr<MapType> map) {
+        current_.store(map.get(), std::memory_order_seq_cst);
+        retired_.emplace_back(std::move(owned_), epoch_.fetch_add(1, std::memory_order_seq_cst));
+        owned_ = std::move(map);
+        uint64_t oldest = IDLE;
+        for (const Slot &slot : slots_) {
+            oldest = std::min(oldest, slot.epoch.load(std::memory_order_seq_cst));
+        }
+        size_t kept = 0;
+        for (auto &retired : retired_) {
+            if (retired.second >= oldest) {
+                retired_[kept++] = std::move(retired);
+            }
+        }
+        retired_.resize(kept);
+    }
+
+    std::unique_ptr<MapType> owned_;  // the current version
+    std::atomic<const MapType *> current_;
+    std::atomic<uint64_t> epoch_;
+    std::vector<std::pair<std::unique_ptr<MapType>, uint64_t>> retired_;  // with the epoch they were retired in
+    mutable std::list<Slot> slots_;  // stable addresses, slots of destroyed readers are reused
+    mutable std::mutex writer_mutex_;
+};
@@ -1,174 +1,864 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <cstdlib>
+#include <exception>
 #include <iostream>
+#include <iterator>
 #include <list>
+#include <unordered_map>
 #include <vector>
 #include <memory>
+#include <memory_resource>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 // We use Hopscotch hashing as an internal algorithm for the HashMap class
 // You can read more about it here: http://mcg.cs.tau.ac.il/papers/disc2008-hopscotch.pdf
+// SwissBucketArray is an alternative engine based on per-slot control bytes (as in Abseil's SwissTable),
+// it can be selected through the Table template parameter of HashMap
+// Pairs that could not be placed into the table (hopscotch displacement failed) go to a separate hashed stash
+// The building blocks live in a named namespace, so HashMap<K, V> names the same type in every translation unit.
+// The ones that appear in the public interface are brought to the global namespace after it
+
+namespace hash_map_detail {
+    inline constexpr size_t NEXT = 32;
+    inline constexpr size_t INITIAL_SIZE = 32;
+    inline constexpr long double MAX_LOAD_FACTOR = 0.5;
+    inline constexpr long double SHRINK_GAP = 8;  // automatic shrinking starts at MAX_LOAD_FACTOR / SHRINK_GAP
+    inline constexpr size_t MIGRATION_STEP = 64;  // slots of the old table migrated per insertion or erasure during a resize
+    inline constexpr size_t INIT_STEP = size_t(1) << 12;  // buckets of the new table zeroed per step before that
+    inline constexpr size_t HUGE_PAGE_SIZE = size_t(1) << 21;  // blocks this large are mapped by HugePageAllocator
+    inline constexpr size_t PREFETCH_DISTANCE = 16;  // how many keys ahead of the probed one find_many() prefetches
+    inline constexpr size_t PARALLEL_MIN_BUCKETS = size_t(1) << 16;  // each thread of a parallel rebuild gets at least this many
+
+    // Compile-time parameters of a table: the hopscotch neighbourhood size (8, 16, 32 or 64 slots),
+    // the default max load factor in percent (up to 90) and the least number of buckets
+    template<size_t Next = NEXT, size_t MaxLoadPercent = 50, size_t InitialSize = INITIAL_SIZE>
+    struct TablePolicy {
+        static_assert(Next == 8 || Next == 16 || Next == 32 || Next == 64, "Neighbourhood must be 8, 16, 32 or 64 slots");
+        static_assert(MaxLoadPercent > 0 && MaxLoadPercent <= 90, "Max load factor must be in (0, 0.9]");
+
+        static constexpr size_t NEXT = Next;
+        static constexpr size_t INITIAL_SIZE = InitialSize;
+        static constexpr long double MAX_LOAD_FACTOR = MaxLoadPercent / 100.0L;
+
+        // one bit per slot of the NEXT-wide neighbourhood
+        using HopInfoType = std::conditional_t<Next == 8, uint8_t, std::conditional_t<Next == 16, uint16_t,
+                std::conditional_t<Next == 32, uint32_t, uint64_t>>>;
+    };
+
+    inline constexpr size_t SIZE_T_BITS = sizeof(size_t) * 8;
+    inline constexpr size_t FIBONACCI_MULTIPLIER = static_cast<size_t>(11400714819323198485ull);  // 2^64 / golden ratio
+
+    using HashFragmentType = uint32_t;  // the top bits of a mixed hash, cached per slot
+    inline constexpr size_t FRAGMENT_BITS = 32;
+
+    template<class Hash, class = void>
+    struct IsTransparent : std::false_type {};
 
-namespace {
-    const size_t NEXT = 32;
-    const size_t INITIAL_SIZE = 32;
-    const long double MIN_LOAD_FACTOR = 0.1;
-    const long double MAX_LOAD_FACTOR = 0.5;
+    template<class Hash>
+    struct IsTransparent<Hash, std::void_t<typename Hash::is_transparent>> : std::true_type {};
 
+    inline size_t LowestBit(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(mask);
+#else
+        size_t bit = 0;
+        while (!(mask & 1)) {
+            mask >>= 1;
+            ++bit;
+        }
+        return bit;
+#endif
+    }
+
+    // Lets a pair be moved out of a slot together with its key. The slot must be destroyed right after
     template<class KeyType, class ValueType>
-    class Bucket {
-        using StorageType = std::pair<const KeyType, ValueType>;
+    std::pair<KeyType &&, ValueType &&> MoveOut(std::pair<const KeyType, ValueType> &pair) {
+        return {std::move(const_cast<KeyType &>(pair.first)), std::move(pair.second)};
+    }
+
+    inline void PrefetchLine(const void *address) {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(address);
+#elif defined(__SSE2__)
+        _mm_prefetch(static_cast<const char *>(address), _MM_HINT_T0);
+#endif
+    }
+
+    inline size_t Log2(size_t n) {
+        size_t log = 0;
+        while ((size_t(1) << log) < n) {
+            ++log;
+        }
+        return log;
+    }
+
+    template<class Allocator, class T>
+    using Rebind = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+
+    // Fills the next count elements of a vector that is meant to hold size of them, true once it does.
+    // Its storage is reserved in one go, so a large table can be set up a few steps at a time
+    template<class Vector>
+    bool FillStep(Vector &vector, size_t size, size_t count, typename Vector::value_type value = {}) {
+        vector.reserve(size);
+        vector.resize(size - vector.size() > count ? vector.size() + count : size, value);
+        return vector.size() == size;
+    }
+
+    // Pairs live in uninitialized storage without any per-slot flag next to them,
+    // occupancy is kept in a separate packed bitmap. Assignment follows the allocator propagation traits
+    template<class KeyType, class ValueType, class Allocator>
+    class SlotArray {
+        using PairType = std::pair<const KeyType, ValueType>;
+        using WordType = uint64_t;
+        static constexpr size_t WORD_BITS = 64;
+
+        union Slot {
+            Slot() {};
+
+            ~Slot() {};
+
+            PairType pair;
+        };
+
+        using SlotAllocator = Rebind<Allocator, Slot>;
+        using Traits = std::allocator_traits<SlotAllocator>;
+
+        // Pairs of trivially copyable types may change their address with a plain memcpy, so with
+        // the default allocator their storage comes from malloc and Grow() can extend it with realloc
+        static constexpr bool RELOCATABLE = std::is_same_v<SlotAllocator, std::allocator<Slot>>
+                                            && std::is_trivially_copyable_v<KeyType> && std::is_trivially_copyable_v<ValueType>
+                                            && alignof(Slot) <= alignof(std::max_align_t);
     public:
-        Bucket() = default;
+        // If deferred is set, the occupancy bitmap is cleared by InitStep() instead, see BucketArray
+        SlotArray(size_t size, const SlotAllocator &alloc, bool deferred = false)
+                : size_(size), alloc_(alloc), slots_(Allocate(size)), occupied_(alloc) {
+            if (!deferred) {
+                InitStep(size_);
+            }
+        }
 
-        explicit Bucket(const StorageType &pair) : pair_(pair), is_occupied_(true) {};
+        SlotArray(const SlotArray &other) : SlotArray(other, Traits::select_on_container_copy_construction(other.alloc_)) {};
 
-        Bucket(const Bucket &other) {
-            operator=(other);
+        SlotArray(const SlotArray &other, const SlotAllocator &alloc) : SlotArray(other.size_, alloc) {
+            for (size_t i = other.Next(0); i != other.size_; i = other.Next(i + 1)) {
+                Construct(i, other.GetRef(i));
+            }
         }
 
-        Bucket &operator=(const Bucket &other) {
-            if (other.is_occupied_) {
-                auto ref = RootRef();
-                ref.first = other.pair_.first;
-                ref.second = other.pair_.second;
+        SlotArray(SlotArray &&other) noexcept
+                : size_(std::exchange(other.size_, 0)), alloc_(other.alloc_), slots_(std::exchange(other.slots_, nullptr)),
+                  occupied_(std::move(other.occupied_)) {};
+
+        SlotArray &operator=(const SlotArray &other) {
+            if (this != &other) {
+                SlotArray tmp(other, Traits::propagate_on_container_copy_assignment::value ? other.alloc_ : alloc_);
+                Steal(tmp);
             }
-            is_occupied_ = other.is_occupied_;
             return *this;
         }
 
-        bool IsOccupied() const {
-            return is_occupied_;
+        SlotArray &operator=(SlotArray &&other) noexcept(Traits::propagate_on_container_move_assignment::value) {
+            if (this == &other) {
+                return *this;
+            }
+            if (Traits::propagate_on_container_move_assignment::value || alloc_ == other.alloc_) {
+                Steal(other);
+            } else {  // the storage of other cannot be released through alloc_, so the pairs are moved one by one
+                SlotArray tmp(other.size_, alloc_);
+                for (size_t i = other.Next(0); i != other.size_; i = other.Next(i + 1)) {
+                    tmp.Construct(i, MoveOut(other.GetRef(i)));
+                }
+                Steal(tmp);
+            }
+            return *this;
+        }
+
+        ~SlotArray() {
+            Clear();
+        }
+
+        bool InitStep(size_t count) {  // clears the occupancy of the next count slots, true once all of it is
+            return FillStep(occupied_, (size_ + WORD_BITS - 1) / WORD_BITS, count / WORD_BITS + 1);
         }
 
-        bool HasKey(const KeyType &other_key) const {
-            return IsOccupied() && pair_.first == other_key;
+        bool IsOccupied(size_t index) const {
+            return (occupied_[index / WORD_BITS] >> (index % WORD_BITS)) & 1;
         }
 
-        void Set(const std::pair<KeyType, ValueType> &new_pair) {
-            operator=(Bucket({new_pair.first, new_pair.second}));
+        size_t Next(size_t index) const {  // first occupied slot starting from index, Size() if there is none
+            size_t word = index / WORD_BITS;
+            if (word >= occupied_.size()) {
+                return size_;
+            }
+            WordType bits = occupied_[word] & (~WordType(0) << (index % WORD_BITS));
+            while (!bits) {
+                if (++word == occupied_.size()) {
+                    return size_;
+                }
+                bits = occupied_[word];
+            }
+            return word * WORD_BITS + LowestBit(bits);
         }
 
-        void Erase() {
-            is_occupied_ = false;
+        template<class... Args>
+        void Construct(size_t index, Args &&... args) {
+            new(&slots_[index].pair) PairType(std::forward<Args>(args)...);
+            occupied_[index / WORD_BITS] |= WordType(1) << (index % WORD_BITS);
         }
 
-        StorageType &GetRef() {
-            return pair_;
+        void Destroy(size_t index) {
+            slots_[index].pair.~PairType();
+            occupied_[index / WORD_BITS] &= ~(WordType(1) << (index % WORD_BITS));
         }
 
-        const StorageType &GetRef() const {
-            return pair_;
+        PairType &GetRef(size_t index) {
+            return slots_[index].pair;
+        }
+
+        const PairType &GetRef(size_t index) const {
+            return slots_[index].pair;
+        }
+
+        size_t Size() const {
+            return size_;
+        }
+
+        void Grow(size_t new_size) {  // every pair keeps its index
+            if constexpr (RELOCATABLE) {
+                Slot *slots = static_cast<Slot *>(std::realloc(static_cast<void *>(slots_), new_size * sizeof(Slot)));
+                if (!slots) {
+                    throw std::bad_alloc();
+                }
+                slots_ = slots;
+            } else {
+                Slot *slots = Allocate(new_size);
+                for (size_t i = Next(0); i != size_; i = Next(i + 1)) {
+                    new(&slots[i].pair) PairType(MoveOut(slots_[i].pair));
+                    slots_[i].pair.~PairType();
+                }
+                Deallocate(slots_, size_);
+                slots_ = slots;
+            }
+            size_ = new_size;
+            occupied_.resize((new_size + WORD_BITS - 1) / WORD_BITS);
         }
 
     private:
-        auto RootRef() {
-            return std::pair<KeyType &, ValueType &>(const_cast<KeyType &>(pair_.first), pair_.second);
+        void Clear() {
+            for (size_t i = Next(0); i != size_; i = Next(i + 1)) {
+                Destroy(i);
+            }
+            Deallocate(slots_, size_);
+            slots_ = nullptr;
+            size_ = 0;
+        }
+
+        void Steal(SlotArray &other) {  // alloc_ has to be able to release the storage of other
+            Clear();
+            if constexpr (std::is_copy_assignable_v<SlotAllocator>) {
+                alloc_ = other.alloc_;
+            }
+            size_ = std::exchange(other.size_, 0);
+            slots_ = std::exchange(other.slots_, nullptr);
+            occupied_ = std::move(other.occupied_);
+            other.occupied_.clear();
+        }
+
+        Slot *Allocate(size_t size) {
+            if constexpr (RELOCATABLE) {
+                Slot *slots = static_cast<Slot *>(std::malloc(std::max<size_t>(size, 1) * sizeof(Slot)));
+                if (!slots) {
+                    throw std::bad_alloc();
+                }
+                return slots;
+            } else {
+                return Traits::allocate(alloc_, size);
+            }
+        }
+
+        void Deallocate(Slot *slots, size_t size) {
+            if (!slots) {
+                return;
+            }
+            if constexpr (RELOCATABLE) {
+                std::free(slots);
+            } else {
+                Traits::deallocate(alloc_, slots, size);
+            }
         }
 
-        StorageType pair_;
-        bool is_occupied_ = false;
+        size_t size_;
+        SlotAllocator alloc_;
+        Slot *slots_;
+        std::vector<WordType, Rebind<Allocator, WordType>> occupied_;
     };
 
-    template<class KeyType, class ValueType, class Hash>
+    // Both engines address their slots by index, ArraySize() plays the role of the end iterator
+    template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator, class Policy>
     class BucketArray {
         using PairType = std::pair<const KeyType, ValueType>;
+        using HopInfoType = typename Policy::HopInfoType;
+        static constexpr size_t NEXT = Policy::NEXT;
     public:
-        using BArrayType = std::vector<Bucket<KeyType, ValueType>>;
+        static constexpr bool GROWS_IN_PLACE = true;
+
+        // The number of home buckets is rounded up to a power of two, so a home bucket is just the top bits
+        // of a multiplicative (Fibonacci) hash instead of dividing. If deferred is set, the metadata is only
+        // allocated here and zeroed by InitStep(), the array may not be used before that returns true
+        BucketArray(size_t size, Hash hash, KeyEqual key_equal, const Allocator &alloc, bool deferred = false)
+                : shift_(SIZE_T_BITS - std::max<size_t>(Log2(size), 1)),
+                  slots_((size_t(1) << (SIZE_T_BITS - shift_)) + NEXT - 1, alloc, deferred), fragments_(alloc),
+                  hop_info_(alloc), pairs_count_(0), hash_func_(hash), key_equal_(key_equal) {
+            if (!deferred) {
+                InitStep(SIZE_MAX);
+            }
+        }
 
-        BucketArray(size_t size, Hash hash) : array_(size + NEXT - 1), pairs_count_(0), hash_func_(hash) {};
+        bool InitStep(size_t count) {  // zeroes the metadata of the next count buckets, true once all of it is
+            bool slots_done = slots_.InitStep(count);
+            bool fragments_done = FillStep(fragments_, slots_.Size(), count);
+            return FillStep(hop_info_, size_t(1) << (SIZE_T_BITS - shift_), count) && slots_done && fragments_done;
+        }
 
-        BucketArray &operator=(const BucketArray &other) {  // with the same hash func as before, only for Reconstruct()
-            array_ = other.array_;
-            pairs_count_ = other.pairs_count_;
-            return *this;
+        size_t Next(size_t index) const {
+            return slots_.Next(index);
+        }
+
+        template<class K>
+        size_t GetHash(const K &key) const {
+            return MixHash(hash_func_(key));
         }
 
-        auto FirstOccupiedBucket(typename BArrayType::iterator iter) {
-            for (auto it = iter; it != End(); ++it) {
-                if (it->IsOccupied()) return it;
+        static size_t MixHash(size_t hash) {  // GetHash() of a key the hash function maps to hash
+            return hash * FIBONACCI_MULTIPLIER;
+        }
+
+        // The hash of the element in the given slot, rebuilt from its cached fragment
+        // without calling the hash function. Its low bits are zeroes
+        size_t StoredHash(size_t index) const {
+            return size_t(fragments_[index]) << (SIZE_T_BITS - FRAGMENT_BITS);
+        }
+
+        template<class P>
+        size_t Insert(P &&pair) {
+            return Insert(std::forward<P>(pair), GetHash(pair.first));
+        }
+
+        template<class P>
+        size_t Insert(P &&pair, size_t hash) {  // hash is either GetHash(pair.first) or a StoredHash()
+            if (SIZE_T_BITS - shift_ > FRAGMENT_BITS) {  // a fragment is too short to address this many buckets
+                hash = GetHash(pair.first);
             }
-            return End();
+            size_t index = PrepareInsert(hash);
+            if (index != slots_.Size()) {
+                Construct(index, hash, std::forward<P>(pair));
+            }
+            return index;
         }
 
-        auto FirstOccupiedBucket(typename BArrayType::const_iterator iter) const {
-            for (auto it = iter; it != End(); ++it) {
-                if (it->IsOccupied()) return it;
+        // Returns the index of the key if it is present, otherwise the index of a free slot prepared
+        // for it as PrepareInsert does. Both are found without hashing the key again
+        template<class K>
+        std::pair<size_t, bool> FindOrPrepareInsert(const K &key, size_t hash) {
+            size_t index = Find(key, hash);
+            if (index != slots_.Size()) {
+                return {index, true};
             }
-            return End();
+            return {PrepareInsert(hash), false};
         }
 
-        size_t GetIndex(const KeyType &key) const {
-            size_t length = array_.size() - NEXT + 1;
-            return hash_func_(key) % length;
+        // Frees a slot in the neighbourhood of the hash's home bucket for a key which is not in the table,
+        // returns ArraySize() if displacement fails
+        size_t PrepareInsert(size_t hash) {
+            return PrepareInsert(hash, 0, slots_.Size());
         }
 
-        std::pair<bool, PairType &> Insert(const PairType &pair) {
-            PairType fake_pair;
-            std::pair<bool, PairType &> result = {false, fake_pair};
-            size_t arr_index = GetIndex(pair.first);
+        template<class... Args>
+        PairType &Construct(size_t index, size_t hash, Args &&... args) {  // into a slot returned by PrepareInsert
+            slots_.Construct(index, std::forward<Args>(args)...);
+            fragments_[index] = GetFragment(hash);
+            SetHop(hash >> shift_, index - (hash >> shift_));
+            ++pairs_count_;
+            return slots_.GetRef(index);
+        }
+
+        template<class K>
+        bool Erase(const K &key) {
+            size_t hash = GetHash(key);
+            size_t index = Find(key, hash);
+            if (index != slots_.Size()) {
+                Remove(index, hash >> shift_);
+                return true;
+            } else {
+                return false;
+            }
+        }
+
+        void EraseAt(size_t index) {
+            size_t hash = StoredHash(index);
+            if (SIZE_T_BITS - shift_ > FRAGMENT_BITS) {
+                hash = GetHash(slots_.GetRef(index).first);
+            }
+            Remove(index, hash >> shift_);
+        }
+
+        template<class K>
+        size_t Find(const K &key) const {
+            return Find(key, GetHash(key));
+        }
+
+        // Cached fragments are compared first, so expensive key comparisons only run on likely matches
+        template<class K>
+        size_t Find(const K &key, size_t hash) const {
+            size_t arr_index = hash >> shift_;
+            HashFragmentType fragment = GetFragment(hash);
+            for (auto hop_info = hop_info_[arr_index]; hop_info; hop_info &= hop_info - 1) {
+                size_t index = arr_index + LowestBit(hop_info);
+                if (fragments_[index] == fragment && key_equal_(slots_.GetRef(index).first, key)) {
+                    return index;
+                }
+            }
+            return slots_.Size();
+        }
+
+        // The lines Find(key, hash) reads before comparing keys. Prefetching the slots as well
+        // takes more outstanding misses than a core can track and turns out slower
+        void Prefetch(size_t hash) const {
+            size_t home = hash >> shift_;
+            PrefetchLine(&hop_info_[home]);
+            PrefetchLine(&fragments_[home]);
+        }
+
+        PairType &GetRef(size_t index) {
+            return slots_.GetRef(index);
+        }
+
+        const PairType &GetRef(size_t index) const {
+            return slots_.GetRef(index);
+        }
+
+        size_t PairsCount() const {
+            return pairs_count_;
+        }
+
+        size_t ArraySize() const {
+            return slots_.Size();
+        }
+
+        size_t BucketCount() const {
+            return hop_info_.size();
+        }
+
+        long double LoadFactor() const {  // the NEXT - 1 tail slots are not counted as capacity
+            return static_cast<long double>(pairs_count_) / hop_info_.size();
+        }
+
+        // Moves every pair of source, an array with the same hash function, into this empty array on up to threads
+        // threads. Home buckets are the top bits of the hash in both arrays, so the slots of source split into
+        // the same ranges as the buckets here: each thread moves the pairs of its share of source into its share
+        // of buckets, looking for free slots and displacing pairs only there. Shares are whole words of the
+        // occupancy bitmap. Pairs whose neighbourhood crosses into the next share are moved afterwards on this
+        // thread, pairs that cannot be placed at all are passed to overflow and stay in source
+        template<class F>
+        void MoveFrom(BucketArray &source, size_t threads, F &&overflow) {
+            size_t parts = 1;
+            while (parts * 2 <= threads && BucketCount() / (parts * 2) >= PARALLEL_MIN_BUCKETS
+                   && source.BucketCount() >= parts * 2) {
+                parts *= 2;
+            }
+            std::vector<std::vector<size_t>> deferred(parts);
+            std::vector<size_t> placed(parts);
+            std::vector<std::exception_ptr> errors(parts);
+            auto move_part = [&](size_t part) {
+                try {
+                    size_t begin = part * (BucketCount() / parts);
+                    size_t end = part + 1 == parts ? slots_.Size() : begin + BucketCount() / parts;
+                    size_t source_begin = part * (source.BucketCount() / parts);
+                    size_t source_end = part + 1 == parts ? source.ArraySize() : source_begin + source.BucketCount() / parts;
+                    for (size_t i = source.Next(source_begin); i < source_end; i = source.Next(i + 1)) {
+                        size_t hash = source.StoredHash(i);
+                        if (SIZE_T_BITS - shift_ > FRAGMENT_BITS) {
+                            hash = GetHash(source.GetRef(i).first);
+                        }
+                        size_t home = hash >> shift_;
+                        size_t index = home >= begin && home < begin + BucketCount() / parts
+                                       ? PrepareInsert(hash, begin, end) : slots_.Size();
+                        if (index == slots_.Size()) {
+                            deferred[part].push_back(i);
+                            continue;
+                        }
+                        slots_.Construct(index, MoveOut(source.GetRef(i)));
+                        fragments_[index] = GetFragment(hash);
+                        SetHop(home, index - home);
+                        ++placed[part];
+                    }
+                } catch (...) {
+                    errors[part] = std::current_exception();
+                }
+            };
+            std::vector<std::thread> workers;
+            workers.reserve(parts);  // nothing but starting a thread can throw once some are running
+            for (size_t part = 1; part < parts; ++part) {
+                try {
+                    workers.emplace_back(move_part, part);
+                } catch (const std::system_error &) {  // no thread to spare, the share is moved on this thread
+                    move_part(part);
+                }
+            }
+            move_part(0);
+            for (auto &worker : workers) {
+                worker.join();
+            }
+            for (size_t part = 0; part < parts; ++part) {
+                if (errors[part]) {
+                    std::rethrow_exception(errors[part]);
+                }
+                pairs_count_ += placed[part];
+            }
+            for (const auto &indices : deferred) {
+                for (size_t i : indices) {
+                    if (Insert(MoveOut(source.GetRef(i)), source.StoredHash(i)) == slots_.Size()) {
+                        overflow(source.GetRef(i));
+                    }
+                }
+            }
+        }
+
+        // Doubles the number of buckets within the same storage, extended in place where possible.
+        // Home bucket h splits into 2h and 2h + 1, so pairs are re-placed starting from the end of the array:
+        // apart from the first NEXT buckets, their new neighbourhoods lie past every pair still waiting to move.
+        // Pairs that cannot be placed are passed to overflow
+        template<class F>
+        void Grow(F &&overflow) {
+            size_t old_size = slots_.Size();
+            std::vector<bool> pending(old_size);
+            for (size_t i = slots_.Next(0); i != old_size; i = slots_.Next(i + 1)) {
+                pending[i] = true;
+            }
+            slots_.Grow(hop_info_.size() * 2 + NEXT - 1);
+            fragments_.resize(slots_.Size());
+            hop_info_.assign(hop_info_.size() * 2, 0);
+            --shift_;
+            pairs_count_ = 0;
+            for (size_t i = old_size; i-- > 0;) {
+                if (!pending[i]) {
+                    continue;
+                }
+                size_t hash = StoredHash(i);
+                std::pair<KeyType, ValueType> pair(MoveOut(slots_.GetRef(i)));
+                slots_.Destroy(i);
+                if (Insert(std::move(pair), hash) == slots_.Size()) {
+                    overflow(std::move(pair));
+                }
+            }
+        }
+
+    private:
+        // PrepareInsert that only uses slots in [begin, end) and only displaces pairs whose home is past begin
+        size_t PrepareInsert(size_t hash, size_t begin, size_t end) {
+            size_t arr_index = hash >> shift_;
             size_t empty_bucket = arr_index;
-            for (; empty_bucket < array_.size(); ++empty_bucket) {
-                if (!array_[empty_bucket].IsOccupied()) {
+            for (; empty_bucket < end; ++empty_bucket) {
+                if (!slots_.IsOccupied(empty_bucket)) {
                     break;
                 }
             }
-            if (empty_bucket == array_.size()) {
-                return result;
-            } else {
-                bool swapped = true;
-                while (arr_index + NEXT <= empty_bucket) {
-                    swapped = false;
-                    for (size_t pot_bucket = empty_bucket - NEXT + 1; pot_bucket < empty_bucket; ++pot_bucket) {
-                        size_t ideal_index = GetIndex(array_[pot_bucket].GetRef().first);
-                        if (empty_bucket < ideal_index + NEXT) {
-                            std::swap(array_[pot_bucket], array_[empty_bucket]);
-                            empty_bucket = pot_bucket;
-                            swapped = true;
-                        }
+            if (empty_bucket == end) {
+                return slots_.Size();
+            }
+            while (arr_index + NEXT <= empty_bucket) {
+                if (!MoveCloser(empty_bucket, begin)) {
+                    return slots_.Size();
+                }
+            }
+            return empty_bucket;
+        }
+
+        void Remove(size_t index, size_t home) {
+            slots_.Destroy(index);
+            ResetHop(home, index - home);
+            --pairs_count_;
+        }
+
+        // Bit i of hop_info_[home] is set iff the slot home + i holds a key whose home bucket is home
+        void SetHop(size_t home, size_t offset) {
+            hop_info_[home] |= HopInfoType(1) << offset;
+        }
+
+        void ResetHop(size_t home, size_t offset) {
+            hop_info_[home] &= ~(HopInfoType(1) << offset);
+        }
+
+        static HashFragmentType GetFragment(size_t hash) {
+            return static_cast<HashFragmentType>(hash >> (SIZE_T_BITS - FRAGMENT_BITS));
+        }
+
+        // Moves the empty slot closer to the start of the array by relocating an element
+        // from one of the NEXT - 1 preceding home buckets into it, without leaving that element's neighbourhood
+        bool MoveCloser(size_t &empty_bucket, size_t begin) {
+            for (size_t home = std::max(empty_bucket - NEXT + 1, begin); home < empty_bucket; ++home) {
+                auto hop_info = hop_info_[home];
+                if (hop_info) {
+                    size_t offset = LowestBit(hop_info);
+                    size_t from = home + offset;
+                    if (from < empty_bucket) {
+                        slots_.Construct(empty_bucket, MoveOut(slots_.GetRef(from)));
+                        slots_.Destroy(from);
+                        fragments_[empty_bucket] = fragments_[from];
+                        SetHop(home, empty_bucket - home);
+                        ResetHop(home, offset);
+                        empty_bucket = from;
+                        return true;
                     }
-                    if (!swapped) {
-                        break;
+                }
+            }
+            return false;
+        }
+
+        size_t shift_;
+        SlotArray<KeyType, ValueType, Allocator> slots_;
+        std::vector<HashFragmentType, Rebind<Allocator, HashFragmentType>> fragments_;
+        std::vector<HopInfoType, Rebind<Allocator, HopInfoType>> hop_info_;
+        size_t pairs_count_;
+        Hash hash_func_;
+        KeyEqual key_equal_;
+    };
+
+    inline constexpr size_t GROUP_WIDTH = 16;
+
+    using ControlByte = int8_t;  // EMPTY, DELETED or the 7 high bits of the hash of a stored key
+    inline constexpr ControlByte EMPTY = -128;
+    inline constexpr ControlByte DELETED = -2;
+
+    class Group {  // GROUP_WIDTH consecutive control bytes, each match is a bitmask over them
+    public:
+        explicit Group(const ControlByte *pos) {
+#ifdef __SSE2__
+            ctrl_ = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+#else
+            ctrl_ = pos;
+#endif
+        }
+
+        uint32_t Match(ControlByte h2) const {
+#ifdef __SSE2__
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl_, _mm_set1_epi8(h2)));
+#else
+            uint32_t mask = 0;
+            for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+                mask |= uint32_t(ctrl_[i] == h2) << i;
+            }
+            return mask;
+#endif
+        }
+
+        uint32_t MatchEmpty() const {
+            return Match(EMPTY);
+        }
+
+        uint32_t MatchEmptyOrDeleted() const {
+#ifdef __SSE2__
+            return _mm_movemask_epi8(_mm_cmplt_epi8(ctrl_, _mm_set1_epi8(-1)));
+#else
+            uint32_t mask = 0;
+            for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+                mask |= uint32_t(ctrl_[i] < -1) << i;
+            }
+            return mask;
+#endif
+        }
+
+    private:
+#ifdef __SSE2__
+        __m128i ctrl_;
+#else
+        const ControlByte *ctrl_;
+#endif
+    };
+
+    // Policy::NEXT is not used here
+    template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator, class Policy>
+    class SwissBucketArray {
+        using PairType = std::pair<const KeyType, ValueType>;
+    public:
+        static constexpr bool GROWS_IN_PLACE = false;
+
+        // The first GROUP_WIDTH - 1 control bytes are mirrored past the end, so a group never has to wrap around.
+        // The size is a power of two not less than GROUP_WIDTH, positions wrap around with a mask
+        // deferred works as in BucketArray
+        SwissBucketArray(size_t size, Hash hash, KeyEqual key_equal, const Allocator &alloc, bool deferred = false)
+                : shift_(SIZE_T_BITS - std::max(Log2(size), Log2(GROUP_WIDTH))),
+                  slots_(size_t(1) << (SIZE_T_BITS - shift_), alloc, deferred), ctrl_(alloc), pairs_count_(0),
+                  deleted_count_(0), hash_func_(hash), key_equal_(key_equal) {
+            if (!deferred) {
+                InitStep(SIZE_MAX);
+            }
+        }
+
+        bool InitStep(size_t count) {  // marks the next count slots empty, true once all of them are
+            bool slots_done = slots_.InitStep(count);
+            return FillStep(ctrl_, slots_.Size() + GROUP_WIDTH - 1, count, EMPTY) && slots_done;
+        }
+
+        size_t Next(size_t index) const {
+            return slots_.Next(index);
+        }
+
+        // Only H2 is cached in the control bytes, so the hash has to be recomputed here
+        size_t StoredHash(size_t index) const {
+            return GetHash(slots_.GetRef(index).first);
+        }
+
+        template<class P>
+        size_t Insert(P &&pair) {
+            return Insert(std::forward<P>(pair), GetHash(pair.first));
+        }
+
+        template<class P>
+        size_t Insert(P &&pair, size_t hash) {
+            size_t index = PrepareInsert(hash);
+            if (index != slots_.Size()) {
+                Construct(index, hash, std::forward<P>(pair));
+            }
+            return index;
+        }
+
+        // Looks for the key and remembers the first free slot along the same probe sequence,
+        // so an absent key is placed without probing again
+        template<class K>
+        std::pair<size_t, bool> FindOrPrepareInsert(const K &key, size_t hash) const {
+            ControlByte h2 = GetH2(hash);
+            size_t pos = GetH1(hash);
+            size_t free_index = slots_.Size();
+            for (size_t probe = 0; probe < slots_.Size(); probe += GROUP_WIDTH) {
+                Group group(&ctrl_[pos]);
+                for (auto mask = group.Match(h2); mask; mask &= mask - 1) {
+                    size_t index = (pos + LowestBit(mask)) & (slots_.Size() - 1);
+                    if (key_equal_(slots_.GetRef(index).first, key)) {
+                        return {index, true};
                     }
                 }
-                if (swapped) {
-                    array_[empty_bucket].Set(pair);
-                    ++pairs_count_;
-                    return {true, array_[empty_bucket].GetRef()};
-                } else {
-                    return result;
+                if (free_index == slots_.Size()) {
+                    if (auto mask = group.MatchEmptyOrDeleted()) {
+                        free_index = (pos + LowestBit(mask)) & (slots_.Size() - 1);
+                    }
+                }
+                if (group.MatchEmpty()) {
+                    break;
+                }
+                pos = (pos + GROUP_WIDTH) & (slots_.Size() - 1);
+            }
+            return {free_index, false};
+        }
+
+        size_t PrepareInsert(size_t hash) const {  // the first free slot along the probe sequence of the hash
+            size_t pos = GetH1(hash);
+            for (size_t probe = 0; probe < slots_.Size(); probe += GROUP_WIDTH) {
+                if (auto mask = Group(&ctrl_[pos]).MatchEmptyOrDeleted()) {
+                    return (pos + LowestBit(mask)) & (slots_.Size() - 1);
+                }
+                pos = (pos + GROUP_WIDTH) & (slots_.Size() - 1);
+            }
+            return slots_.Size();
+        }
+
+        // Probe sequences wrap around the whole array, so there are no independent shares to fill
+        // on several threads. Pairs are moved on this thread, the ones that cannot be placed go to overflow
+        template<class F>
+        void MoveFrom(SwissBucketArray &source, size_t /* threads */, F &&overflow) {
+            for (size_t i = source.Next(0); i != source.ArraySize(); i = source.Next(i + 1)) {
+                if (Insert(MoveOut(source.GetRef(i)), source.StoredHash(i)) == slots_.Size()) {
+                    overflow(source.GetRef(i));
                 }
             }
         }
 
-        bool Erase(const KeyType &key) {
-            auto it = Find(key);
-            if (it != array_.end()) {
-                it->Erase();
-                --pairs_count_;
+        template<class... Args>
+        PairType &Construct(size_t index, size_t hash, Args &&... args) {  // into a slot returned by PrepareInsert
+            slots_.Construct(index, std::forward<Args>(args)...);
+            if (ctrl_[index] == DELETED) {
+                --deleted_count_;
+            }
+            SetControl(index, GetH2(hash));
+            ++pairs_count_;
+            return slots_.GetRef(index);
+        }
+
+        template<class K>
+        bool Erase(const K &key) {
+            size_t index = Find(key);
+            if (index != slots_.Size()) {
+                EraseAt(index);
                 return true;
             } else {
                 return false;
             }
         }
 
-        auto Find(const KeyType &key) const {
-            size_t arr_index = GetIndex(key);
-            for (size_t i = arr_index; i < arr_index + NEXT; ++i) {
-                if (array_[i].HasKey(key)) {
-                    return array_.begin() + i;
-                }
-            }
-            return array_.end();
+        void EraseAt(size_t index) {
+            slots_.Destroy(index);
+            SetControl(index, DELETED);
+            --pairs_count_;
+            ++deleted_count_;
+        }
+
+        template<class K>
+        size_t Find(const K &key) const {
+            return Find(key, GetHash(key));
         }
 
-        auto Find(const KeyType &key) {
-            size_t arr_index = GetIndex(key);
-            for (size_t i = arr_index; i < arr_index + NEXT; ++i) {
-                if (array_[i].HasKey(key)) {
-                    return array_.begin() + i;
+        template<class K>
+        size_t Find(const K &key, size_t hash) const {
+            ControlByte h2 = GetH2(hash);
+            size_t pos = GetH1(hash);
+            for (size_t probe = 0; probe < slots_.Size(); probe += GROUP_WIDTH) {
+                Group group(&ctrl_[pos]);
+                for (auto mask = group.Match(h2); mask; mask &= mask - 1) {
+                    size_t index = (pos + LowestBit(mask)) & (slots_.Size() - 1);
+                    if (key_equal_(slots_.GetRef(index).first, key)) {
+                        return index;
+                    }
                 }
+                if (group.MatchEmpty()) {
+                    break;
+                }
+                pos = (pos + GROUP_WIDTH) & (slots_.Size() - 1);
             }
-            return array_.end();
+            return slots_.Size();
+        }
+
+        void Prefetch(size_t hash) const {  // the first group Find(key, hash) probes
+            size_t pos = GetH1(hash);
+            PrefetchLine(&ctrl_[pos]);
+            PrefetchLine(&slots_.GetRef(pos));
+        }
+
+        PairType &GetRef(size_t index) {
+            return slots_.GetRef(index);
+        }
+
+        const PairType &GetRef(size_t index) const {
+            return slots_.GetRef(index);
         }
 
         size_t PairsCount() const {
@@ -176,62 +866,346 @@ namespace {
         }
 
         size_t ArraySize() const {
-            return array_.size();
+            return slots_.Size();
         }
 
-        auto Begin() {
-            return array_.begin();
+        size_t BucketCount() const {
+            return slots_.Size();
         }
 
-        auto End() {
-            return array_.end();
+        long double LoadFactor() const {  // tombstones slow down probing as much as live keys do, so they are counted too
+            return static_cast<long double>(pairs_count_ + deleted_count_) / slots_.Size();
         }
 
-        auto Begin() const {
-            return array_.begin();
+        // std::hash is the identity for integers, so the hash is mixed before being split into H1 and H2
+        template<class K>
+        size_t GetHash(const K &key) const {
+            return MixHash(hash_func_(key));
         }
 
-        auto End() const {
-            return array_.end();
+        static size_t MixHash(size_t hash) {
+            return hash * FIBONACCI_MULTIPLIER;
         }
 
-        long double LoadFactor() {
-            return static_cast<long double>(pairs_count_) / array_.size();
+    private:
+        size_t GetH1(size_t hash) const {  // the bits right below H2
+            return (hash << 7) >> shift_;
         }
 
-    private:
-        BArrayType array_;
+        static ControlByte GetH2(size_t hash) {
+            return static_cast<ControlByte>(hash >> (SIZE_T_BITS - 7));
+        }
+
+        void SetControl(size_t index, ControlByte value) {
+            ctrl_[index] = value;
+            if (index < GROUP_WIDTH - 1) {
+                ctrl_[slots_.Size() + index] = value;
+            }
+        }
+
+        size_t shift_;
+        SlotArray<KeyType, ValueType, Allocator> slots_;
+        std::vector<ControlByte, Rebind<Allocator, ControlByte>> ctrl_;
         size_t pairs_count_;
+        size_t deleted_count_;
         Hash hash_func_;
+        KeyEqual key_equal_;
+    };
+
+
+    // Decides when and to which size the table is rebuilt before an insertion. The table grows once
+    // its load factor exceeds max_load. If auto_shrink is set, it shrinks once the share of live pairs
+    // drops below max_load / SHRINK_GAP, straight to the size where that share is about max_load / 4.
+    // The wide band between the two thresholds keeps alternating inserts and erases from rebuilding
+    // the table over and over. Without auto_shrink, only shrink_to_fit() and rehash() shrink it.
+    // max_load must be in (0, 0.9] as in TablePolicy: a full Swiss table would never exceed it and grow.
+    // If incremental is set, pairs are moved to the new table a few slots per insertion or erasure instead of all at once.
+    // If in_place is set, doubling a hopscotch table reuses its storage instead of building a second table.
+    // If threads is above one, rebuilding a large hopscotch table into a new one is spread over that many threads.
+    // Options are changed one by one with the setters, usually starting from the policy of a map:
+    //     auto policy = map.resize_policy();
+    //     map.resize_policy(policy.SetIncremental(true).SetThreads(4));
+    class ResizePolicy {
+    public:
+        explicit ResizePolicy(long double max_load = MAX_LOAD_FACTOR) {
+            SetMaxLoadFactor(max_load);
+        }
+
+        ResizePolicy &SetMaxLoadFactor(long double max_load) {
+            if (!(max_load > 0 && max_load <= 0.9)) {
+                throw std::invalid_argument("Max load factor must be in (0, 0.9]");
+            }
+            max_load_ = max_load;
+            return *this;
+        }
+
+        ResizePolicy &SetAutoShrink(bool auto_shrink) {
+            auto_shrink_ = auto_shrink;
+            return *this;
+        }
+
+        ResizePolicy &SetIncremental(bool incremental) {
+            incremental_ = incremental;
+            return *this;
+        }
+
+        ResizePolicy &SetInPlace(bool in_place) {
+            in_place_ = in_place;
+            return *this;
+        }
+
+        ResizePolicy &SetThreads(size_t threads) {
+            threads_ = threads;
+            return *this;
+        }
+
+        long double MaxLoadFactor() const {
+            return max_load_;
+        }
+
+        bool AutoShrink() const {
+            return auto_shrink_;
+        }
+
+        bool Incremental() const {
+            return incremental_;
+        }
+
+        bool InPlace() const {
+            return in_place_;
+        }
+
+        size_t Threads() const {
+            return threads_;
+        }
+
+        size_t BucketsFor(size_t pairs) const {  // the least bucket count that holds pairs without growing
+            return static_cast<size_t>(pairs / max_load_) + 1;
+        }
+
+        // Returns 0 if the table should stay as it is. load_factor may count more than the live pairs
+        // (tombstones of SwissBucketArray), in that case a rebuild of the same size is enough
+        size_t NewBucketCount(size_t pairs, long double load_factor, size_t buckets, size_t min_buckets) const {
+            if (load_factor > max_load_) {
+                if (pairs > buckets * max_load_ / 2) {
+                    return std::max(buckets * 2, BucketsFor(pairs + 1));
+                }
+                return buckets;
+            }
+            if (auto_shrink_ && pairs < buckets * max_load_ / SHRINK_GAP) {
+                size_t new_size = std::max(BucketsFor(pairs) * 2, min_buckets);
+                if (new_size <= buckets / 2) {
+                    return new_size;
+                }
+            }
+            return 0;
+        }
+
+    private:
+        long double max_load_;
+        bool auto_shrink_ = false;
+        bool incremental_ = false;
+        bool in_place_ = false;
+        size_t threads_ = 1;
+    };
+
+
+    // Maps blocks of at least HUGE_PAGE_SIZE bytes with mmap, aligned to HUGE_PAGE_SIZE, and asks the kernel
+    // to back them with transparent huge pages (or with hugetlbfs pages if hugetlb is set and any are reserved),
+    // so random probing of a large table takes far fewer TLB misses. If numa_nodes is not zero, it is a bitmask
+    // of the NUMA nodes the pages are interleaved across, a single bit binds them to that node.
+    // Smaller blocks, and all blocks outside Linux, come from operator new
+    template<class T>
+    class HugePageAllocator {
+        template<class U>
+        friend class HugePageAllocator;
+    public:
+        using value_type = T;
+
+        explicit HugePageAllocator(uint64_t numa_nodes = 0, bool hugetlb = false) noexcept
+                : numa_nodes_(numa_nodes), hugetlb_(hugetlb) {};
+
+        template<class U>
+        HugePageAllocator(const HugePageAllocator<U> &other) noexcept : numa_nodes_(other.numa_nodes_), hugetlb_(other.hugetlb_) {};
+
+        T *allocate(size_t n) {
+            if (n > SIZE_MAX / sizeof(T)) {
+                throw std::bad_alloc();
+            }
+#ifdef __linux__
+            if (n * sizeof(T) >= HUGE_PAGE_SIZE) {
+                return static_cast<T *>(Map(MappedSize(n)));
+            }
+#endif
+            return std::allocator<T>().allocate(n);
+        }
+
+        void deallocate(T *ptr, size_t n) noexcept {
+#ifdef __linux__
+            if (n * sizeof(T) >= HUGE_PAGE_SIZE) {
+                munmap(ptr, MappedSize(n));
+                return;
+            }
+#endif
+            std::allocator<T>().deallocate(ptr, n);
+        }
+
+        template<class U>
+        bool operator==(const HugePageAllocator<U> &other) const {
+            return numa_nodes_ == other.numa_nodes_ && hugetlb_ == other.hugetlb_;
+        }
+
+        template<class U>
+        bool operator!=(const HugePageAllocator<U> &other) const {
+            return !operator==(other);
+        }
+
+    private:
+        static size_t MappedSize(size_t n) {
+            return (n * sizeof(T) + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        }
+
+#ifdef __linux__
+        void *Map(size_t length) const {
+            if (hugetlb_) {
+                void *ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (ptr != MAP_FAILED) {
+                    Bind(ptr, length);
+                    return ptr;
+                }
+            }
+            // mmap only guarantees the alignment of a small page, so the block is cut out of a larger mapping
+            void *raw = mmap(nullptr, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+            uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+            if (aligned != start) {
+                munmap(raw, aligned - start);
+            }
+            munmap(reinterpret_cast<void *>(aligned + length), start + HUGE_PAGE_SIZE - aligned);
+            void *ptr = reinterpret_cast<void *>(aligned);
+            madvise(ptr, length, MADV_HUGEPAGE);  // only a hint, the block works with small pages as well
+            Bind(ptr, length);
+            return ptr;
+        }
+
+        void Bind(void *ptr, size_t length) const {  // before the pages are touched, so they are placed right away
+            if (!numa_nodes_) {
+                return;
+            }
+            // MPOL_BIND and MPOL_INTERLEAVE of linux/mempolicy.h. Those names are macros in numaif.h,
+            // and libnuma is not required
+            const int MEMPOLICY_BIND = 2;
+            const int MEMPOLICY_INTERLEAVE = 3;
+            unsigned long mask = numa_nodes_;
+            int mode = (numa_nodes_ & (numa_nodes_ - 1)) ? MEMPOLICY_INTERLEAVE : MEMPOLICY_BIND;
+            syscall(SYS_mbind, ptr, length, mode, &mask, sizeof(mask) * 8 + 1, 0);  // a failure leaves the default policy
+        }
+#endif
+
+        uint64_t numa_nodes_;
+        bool hugetlb_;
     };
 }
 
-template<class KeyType, class ValueType, class Hash = std::hash<KeyType>>
+using hash_map_detail::TablePolicy;
+using hash_map_detail::BucketArray;
+using hash_map_detail::SwissBucketArray;
+using hash_map_detail::ResizePolicy;
+using hash_map_detail::HugePageAllocator;
+
+// Hashes each key once and hands the hash to its shard, see concurrent_hash_map.h
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator, class Policy>
+class ConcurrentHashMap;
+
+// Every table and the stash allocate through (a rebound copy of) Allocator
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+        class Allocator = std::allocator<std::pair<const KeyType, ValueType>>, class Policy = TablePolicy<>,
+        template<class, class, class, class, class, class> class Table = BucketArray>
 class HashMap {
     using PairType = std::pair<const KeyType, ValueType>;
-    using BucketType = Bucket<KeyType, ValueType>;
-    using BArray = BucketArray<KeyType, ValueType, Hash>;
-    using ListType = std::vector<BucketType>;
-    using BucketArrayIterator = typename BArray::BArrayType::iterator;
-    using BucketArrayConstIterator = typename BArray::BArrayType::const_iterator;
-    using ListIterator = typename ListType::iterator;
-    using ListConstIterator = typename ListType::const_iterator;
+    using BArray = Table<KeyType, ValueType, Hash, KeyEqual, Allocator, Policy>;
+    static constexpr size_t INITIAL_SIZE = Policy::INITIAL_SIZE;
+    using StashType = std::unordered_map<KeyType, ValueType, Hash, KeyEqual, Allocator>;
+    using StashIterator = typename StashType::iterator;
+    using StashConstIterator = typename StashType::const_iterator;
+
+    // Lookups take any key type if both Hash and KeyEqual define is_transparent (as std::equal_to<> does),
+    // e.g. std::string_view for std::string keys. Such a key must hash as the equal KeyType does
+    template<class K>
+    using TransparentKey = std::enable_if_t<hash_map_detail::IsTransparent<Hash>::value
+                                            && hash_map_detail::IsTransparent<KeyEqual>::value, K>;
 public:
 
-    explicit HashMap(const Hash &hash = Hash()) : hash_func_(hash), b_array_(INITIAL_SIZE, hash) {};
+    explicit HashMap(const Hash &hash = Hash(), const KeyEqual &key_equal = KeyEqual(), const Allocator &alloc = Allocator())
+            : HashMap(INITIAL_SIZE, hash, key_equal, alloc) {};
+
+    explicit HashMap(const Allocator &alloc) : HashMap(INITIAL_SIZE, Hash(), KeyEqual(), alloc) {};
+
+    // The table never shrinks below bucket_count buckets until the next rehash() or reserve()
+    explicit HashMap(size_t bucket_count, const Hash &hash = Hash(), const KeyEqual &key_equal = KeyEqual(),
+                     const Allocator &alloc = Allocator())
+            : hash_func_(hash), key_equal_(key_equal), resize_policy_(Policy::MAX_LOAD_FACTOR),
+              min_bucket_count_(std::max(bucket_count, INITIAL_SIZE)), b_array_(min_bucket_count_, hash, key_equal, alloc),
+              stash_(0, hash, key_equal, alloc) {};
+
+    HashMap(size_t bucket_count, const Allocator &alloc) : HashMap(bucket_count, Hash(), KeyEqual(), alloc) {};
 
-    HashMap(std::initializer_list<PairType> init_list, const Hash &hash = Hash())
-            : HashMap(init_list.begin(), init_list.end(), hash) {};
+    HashMap(std::initializer_list<PairType> init_list, const Hash &hash = Hash(), const KeyEqual &key_equal = KeyEqual(),
+            const Allocator &alloc = Allocator())
+            : HashMap(init_list.begin(), init_list.end(), hash, key_equal, alloc) {};
+
+    HashMap(std::initializer_list<PairType> init_list, size_t bucket_count, const Hash &hash = Hash(),
+            const KeyEqual &key_equal = KeyEqual(), const Allocator &alloc = Allocator())
+            : HashMap(init_list.begin(), init_list.end(), bucket_count, hash, key_equal, alloc) {};
 
     template<class InputIt>
-    HashMap(InputIt first, InputIt second, const Hash &hash = Hash()) : hash_func_(hash), b_array_(INITIAL_SIZE, hash) {
-        for (auto it = first; it != second; ++it) {
-            insert(*it);
-        }
+    HashMap(InputIt first, InputIt second, const Hash &hash = Hash(), const KeyEqual &key_equal = KeyEqual(),
+            const Allocator &alloc = Allocator())
+            : HashMap(first, second, INITIAL_SIZE, hash, key_equal, alloc) {};
+
+    template<class InputIt>
+    HashMap(InputIt first, InputIt second, size_t bucket_count, const Hash &hash = Hash(),
+            const KeyEqual &key_equal = KeyEqual(), const Allocator &alloc = Allocator())
+            : HashMap(bucket_count, hash, key_equal, alloc) {
+        insert(first, second);
     };
 
+    HashMap(const HashMap &other) = default;
+
+    // A moved-from map is an empty table of INITIAL_SIZE buckets, it can be used right away
+    HashMap(HashMap &&other)
+            : hash_func_(other.hash_func_), key_equal_(other.key_equal_), resize_policy_(other.resize_policy_),
+              min_bucket_count_(other.min_bucket_count_), b_array_(std::move(other.b_array_)),
+              new_array_(std::move(other.new_array_)), old_array_(std::move(other.old_array_)), migrated_(other.migrated_),
+              draining_stash_(other.draining_stash_), stash_buckets_(other.stash_buckets_), stash_(std::move(other.stash_)) {
+        other.Reset();
+    }
+
+    HashMap &operator=(const HashMap &other) = default;
+
+    HashMap &operator=(HashMap &&other) {
+        if (this != &other) {
+            hash_func_ = other.hash_func_;
+            key_equal_ = other.key_equal_;
+            resize_policy_ = other.resize_policy_;
+            min_bucket_count_ = other.min_bucket_count_;
+            b_array_ = std::move(other.b_array_);
+            new_array_ = std::move(other.new_array_);
+            old_array_ = std::move(other.old_array_);
+            migrated_ = other.migrated_;
+            draining_stash_ = other.draining_stash_;
+            stash_buckets_ = other.stash_buckets_;
+            stash_ = std::move(other.stash_);
+            other.Reset();
+        }
+        return *this;
+    }
+
     size_t size() const {
-        return b_array_.PairsCount() + list_.size();
+        return b_array_.PairsCount() + (old_array_ ? old_array_->PairsCount() : 0) + stash_.size();
     }
 
     bool empty() const {
@@ -242,46 +1216,81 @@ public:
         return hash_func_;
     }
 
-    void insert(const PairType &pair) {
-        if (find(pair.first) == end()) {
-            ForceInsert(pair);
+    auto key_eq() const {
+        return key_equal_;
+    }
+
+    // The stash follows the standard rules for propagating the allocator on copy, move and swap,
+    // new tables are allocated with its allocator
+    Allocator get_allocator() const {
+        return stash_.get_allocator();
+    }
+
+    size_t bucket_count() const {
+        return b_array_.BucketCount();
+    }
+
+    // Rebuilds the table with at least bucket_count buckets (and at least enough for size() pairs),
+    // later erasures never shrink it below that
+    void rehash(size_t bucket_count) {
+        min_bucket_count_ = std::max(bucket_count, INITIAL_SIZE);
+        size_t new_size = std::max(min_bucket_count_, resize_policy_.BucketsFor(size()));
+        if ((size_t(1) << hash_map_detail::Log2(new_size)) != b_array_.BucketCount()) {
+            Reconstruct(new_size);
         }
     }
 
-    void erase(const KeyType &key) {
-        if (!b_array_.Erase(key)) {
-            for (auto it = list_.begin(); it != list_.end(); ++it) {
-                if (it->GetRef().first == key) {
-                    list_.erase(it);
-                    return;
-                }
-            }
+    void reserve(size_t count) {  // room for count pairs without any further Reconstruct
+        rehash(resize_policy_.BucketsFor(count));
+    }
+
+    void shrink_to_fit() {
+        rehash(0);
+    }
+
+    float max_load_factor() const {
+        return resize_policy_.MaxLoadFactor();
+    }
+
+    void max_load_factor(float max_load) {  // grows the table right away if it is over the new limit
+        resize_policy_.SetMaxLoadFactor(max_load);
+        if (resize_policy_.BucketsFor(size()) > b_array_.BucketCount()) {
+            Reconstruct(resize_policy_.BucketsFor(size()));
         }
     }
 
+    const ResizePolicy &resize_policy() const {
+        return resize_policy_;
+    }
+
+    void resize_policy(const ResizePolicy &policy) {  // takes effect from the next insertion, see ResizePolicy
+        resize_policy_ = policy;
+    }
+
+    size_t erase(const KeyType &key) {  // the number of erased pairs, 0 or 1
+        return EraseKey(key);
+    }
+
+    template<class K, class = TransparentKey<K>>
+    size_t erase(const K &key) {
+        return EraseKey(key);
+    }
+
     template<bool IsConst>
     class RawIterator {
         using ReturnType = std::conditional_t<IsConst, const PairType, PairType>;
-        using BArrayIter = std::conditional_t<IsConst, BucketArrayConstIterator, BucketArrayIterator>;
-        using ListIter = std::conditional_t<IsConst, ListConstIterator, ListIterator>;
+        using MapPtr = std::conditional_t<IsConst, const HashMap *, HashMap *>;
+        using StashIter = std::conditional_t<IsConst, StashConstIterator, StashIterator>;
     public:
-        RawIterator(BArrayIter array_begin, BArrayIter array_end, ListIter list_iter, ListIter list_end)
-                : b_array_iter_(
-                array_begin), b_array_end_(array_end), list_iter_(list_iter), list_end_(list_end) {};
+        RawIterator(MapPtr map, size_t index, StashIter stash_iter) : map_(map), index_(index), stash_iter_(stash_iter) {};
 
         RawIterator() = default;
 
         auto operator++() {
-            if (b_array_iter_ != b_array_end_) {
-                while (b_array_iter_ != b_array_end_) {
-                    ++b_array_iter_;
-                    if (b_array_iter_ != b_array_end_ && b_array_iter_->IsOccupied()) {
-                        return *this;
-                    }
-                }
-                return *this;
+            if (index_ != map_->TableEnd()) {
+                index_ = map_->NextIndex(index_ + 1);
             } else {
-                ++list_iter_;
+                ++stash_iter_;
             }
             return *this;
         }
@@ -293,7 +1302,7 @@ public:
         }
 
         friend bool operator==(const RawIterator &first, const RawIterator &second) {
-            return first.b_array_iter_ == second.b_array_iter_ && first.list_iter_ == second.list_iter_;
+            return first.index_ == second.index_ && first.stash_iter_ == second.stash_iter_;
         }
 
         friend bool operator!=(const RawIterator &first, const RawIterator &second) {
@@ -301,10 +1310,10 @@ public:
         }
 
         ReturnType &operator*() {
-            if (b_array_iter_ != b_array_end_) {
-                return b_array_iter_->GetRef();
+            if (index_ != map_->TableEnd()) {
+                return map_->GetRef(index_);
             } else {
-                return list_iter_->GetRef();
+                return *stash_iter_;
             }
         }
 
@@ -313,71 +1322,261 @@ public:
         }
 
     private:
-        BArrayIter b_array_iter_;
-        BArrayIter b_array_end_;
-        ListIter list_iter_;
-        ListIter list_end_;
+        MapPtr map_ = nullptr;
+        size_t index_ = 0;
+        StashIter stash_iter_;
     };
 
     using iterator = RawIterator<false>;
     using const_iterator = RawIterator<true>;
 
     iterator begin() {
-        return {b_array_.FirstOccupiedBucket(b_array_.Begin()), b_array_.End(), list_.begin(), list_.end()};
+        return {this, NextIndex(0), stash_.begin()};
     }
 
     iterator end() {
-        return {b_array_.End(), b_array_.End(), list_.end(), list_.end()};
+        return {this, TableEnd(), stash_.end()};
     }
 
     const_iterator begin() const {
-        return {b_array_.FirstOccupiedBucket(b_array_.Begin()), b_array_.End(), list_.begin(), list_.end()};
+        return {this, NextIndex(0), stash_.begin()};
     }
 
     const_iterator end() const {
-        return const_iterator(b_array_.End(), b_array_.End(), list_.end(), list_.end());
+        return const_iterator(this, TableEnd(), stash_.end());
     }
 
     iterator find(const KeyType &key) {
-        BucketArrayIterator it = b_array_.Find(key);
-        if (it != b_array_.End()) {
-            return iterator(it, b_array_.End(), list_.begin(), list_.end());
-        } else {
-            for (auto iter = list_.begin(); iter != list_.end(); ++iter) {
-                if (iter->GetRef().first == key) {
-                    return iterator(b_array_.End(), b_array_.End(), iter, list_.end());
-                }
-            }
-            return iterator(b_array_.End(), b_array_.End(), list_.end(), list_.end());
-        }
+        return FindKey(key);
     }
 
     const_iterator find(const KeyType &key) const {
-        auto it = b_array_.Find(key);
-        if (it != b_array_.End()) {
-            return {it, b_array_.End(), list_.begin(), list_.end()};
+        return FindKey(key);
+    }
+
+    template<class K, class = TransparentKey<K>>
+    iterator find(const K &key) {
+        return FindKey(key);
+    }
+
+    template<class K, class = TransparentKey<K>>
+    const_iterator find(const K &key) const {
+        return FindKey(key);
+    }
+
+    bool contains(const KeyType &key) const {
+        return find(key) != end();
+    }
+
+    template<class K, class = TransparentKey<K>>
+    bool contains(const K &key) const {
+        return find(key) != end();
+    }
+
+    // Batched lookups: writes find(key) (or contains(key)) for every key of [first, last) to out.
+    // Many keys are in flight at once, which pays off on tables that do not fit into the cache
+    template<class ForwardIt, class OutputIt>
+    OutputIt find_many(ForwardIt first, ForwardIt last, OutputIt out) {
+        ForEachHashed(first, last, KeyItself(), [this, &out](const auto &key, size_t hash) {
+            *out++ = FindKey(key, hash);
+        });
+        return out;
+    }
+
+    template<class ForwardIt, class OutputIt>
+    OutputIt find_many(ForwardIt first, ForwardIt last, OutputIt out) const {
+        ForEachHashed(first, last, KeyItself(), [this, &out](const auto &key, size_t hash) {
+            *out++ = FindKey(key, hash);
+        });
+        return out;
+    }
+
+    template<class ForwardIt, class OutputIt>
+    OutputIt contains_many(ForwardIt first, ForwardIt last, OutputIt out) const {
+        ForEachHashed(first, last, KeyItself(), [this, &out](const auto &key, size_t hash) {
+            *out++ = FindKey(key, hash) != end();
+        });
+        return out;
+    }
+
+    std::pair<iterator, bool> insert(const PairType &pair) {
+        return FindOrInsert(pair.first, pair);
+    }
+
+    std::pair<iterator, bool> insert(PairType &&pair) {
+        return FindOrInsert(pair.first, std::move(pair));
+    }
+
+    // Bulk load: with forward iterators the table is sized once for all the pairs, then they are placed
+    // with hashing and prefetching running ahead as in find_many(), so no Reconstruct happens in between
+    template<class InputIt>
+    void insert(InputIt first, InputIt last) {
+        if constexpr (std::is_base_of_v<std::forward_iterator_tag, typename std::iterator_traits<InputIt>::iterator_category>) {
+            size_t count = size() + std::distance(first, last);
+            if (resize_policy_.BucketsFor(count) > b_array_.BucketCount()) {
+                Reconstruct(resize_policy_.BucketsFor(count));
+            }
+            ForEachHashed(first, last, PairKey(), [this](const auto &pair, size_t hash) {
+                FindOrInsertHashed(pair.first, hash, pair);
+            });
         } else {
-            for (auto iter = list_.begin(); iter != list_.end(); ++iter) {
-                if (iter->GetRef().first == key) {
-                    return {b_array_.End(), b_array_.End(), iter, list_.end()};
-                }
+            for (; first != last; ++first) {
+                insert(*first);
             }
-            return {b_array_.End(), b_array_.End(), list_.end(), list_.end()};
         }
     }
 
+    void insert(std::initializer_list<PairType> init_list) {
+        insert(init_list.begin(), init_list.end());
+    }
+
+    // The key is looked up before anything is constructed, the value is built in place only if the key is absent
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(const KeyType &key, Args &&... args) {
+        return FindOrInsert(key, std::piecewise_construct, std::forward_as_tuple(key),
+                            std::forward_as_tuple(std::forward<Args>(args)...));
+    }
+
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(KeyType &&key, Args &&... args) {
+        return FindOrInsert(key, std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+                            std::forward_as_tuple(std::forward<Args>(args)...));
+    }
+
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args &&... args) {  // the pair has to be built first to know its key
+        PairType pair(std::forward<Args>(args)...);
+        return FindOrInsert(pair.first, hash_map_detail::MoveOut(pair));
+    }
+
+    template<class M>
+    std::pair<iterator, bool> insert_or_assign(const KeyType &key, M &&obj) {
+        auto result = try_emplace(key, std::forward<M>(obj));
+        if (!result.second) {
+            result.first->second = std::forward<M>(obj);
+        }
+        return result;
+    }
+
+    template<class M>
+    std::pair<iterator, bool> insert_or_assign(KeyType &&key, M &&obj) {
+        auto result = try_emplace(std::move(key), std::forward<M>(obj));
+        if (!result.second) {
+            result.first->second = std::forward<M>(obj);
+        }
+        return result;
+    }
+
     ValueType &operator[](const KeyType &key) {
-        auto it = find(key);
-        if (it == end()) {
-            auto new_pair = std::make_pair(key, ValueType());
-            return ForceInsert(new_pair).second;
+        return try_emplace(key).first->second;
+    }
+
+    ValueType &operator[](KeyType &&key) {
+        return try_emplace(std::move(key)).first->second;
+    }
+
+    template<class K, class = TransparentKey<K>>
+    ValueType &operator[](const K &key) {  // a KeyType is built from key only if it is absent
+        return FindOrInsert(key, std::piecewise_construct, std::forward_as_tuple(key), std::tuple<>()).first->second;
+    }
+
+    const ValueType &at(const KeyType &key) const {
+        return AtKey(key);
+    }
+
+    template<class K, class = TransparentKey<K>>
+    const ValueType &at(const K &key) const {
+        return AtKey(key);
+    }
+
+    void clear() {
+        b_array_ = BArray(b_array_.BucketCount(), hash_func_, key_equal_, get_allocator());
+        new_array_.reset();
+        old_array_.reset();
+        draining_stash_ = false;
+        stash_.clear();
+    }
+
+private:
+    template<class, class, class, class, class, class>
+    friend class ::ConcurrentHashMap;
+
+    struct KeyItself {
+        template<class K>
+        const K &operator()(const K &key) const {
+            return key;
+        }
+    };
+
+    struct PairKey {
+        template<class P>
+        const auto &operator()(const P &pair) const {
+            return pair.first;
+        }
+    };
+
+    // The hash the tables take, computed without reading them, so a caller may hash a key before locking the map.
+    // hash_func_ only changes on assignment of the whole map
+    template<class K>
+    size_t HashOf(const K &key) const {
+        return BArray::MixHash(hash_func_(key));
+    }
+
+    template<class K>
+    StashIterator StashFind(const K &key) {  // std::unordered_map has no heterogeneous lookup before C++20
+        if constexpr (std::is_same_v<K, KeyType>) {
+            return stash_.find(key);
         } else {
-            return it->second;
+            return stash_.find(KeyType(key));
         }
     }
 
-    const ValueType &at(const KeyType &key) const {
-        auto it = find(key);
+    template<class K>
+    StashConstIterator StashFind(const K &key) const {
+        if constexpr (std::is_same_v<K, KeyType>) {
+            return stash_.find(key);
+        } else {
+            return stash_.find(KeyType(key));
+        }
+    }
+
+    template<class K>
+    iterator FindKey(const K &key) {
+        return FindKey(key, b_array_.GetHash(key));
+    }
+
+    template<class K>
+    const_iterator FindKey(const K &key) const {
+        return FindKey(key, b_array_.GetHash(key));
+    }
+
+    template<class K>
+    iterator FindKey(const K &key, size_t hash) {
+        size_t index = FindIndex(key, hash);
+        if (index != TableEnd()) {
+            return iterator(this, index, stash_.begin());
+        } else if (stash_.empty()) {
+            return end();
+        } else {
+            return iterator(this, index, StashFind(key));
+        }
+    }
+
+    template<class K>
+    const_iterator FindKey(const K &key, size_t hash) const {
+        size_t index = FindIndex(key, hash);
+        if (index != TableEnd()) {
+            return {this, index, stash_.begin()};
+        } else if (stash_.empty()) {
+            return end();
+        } else {
+            return {this, index, StashFind(key)};
+        }
+    }
+
+    template<class K>
+    const ValueType &AtKey(const K &key) const {
+        auto it = FindKey(key);
         if (it == end()) {
             throw std::out_of_range("Key was not found");
         } else {
@@ -385,48 +1584,282 @@ public:
         }
     }
 
-    void clear() {
-        Reconstruct(false, true);
+    template<class K>
+    size_t EraseKey(const K &key) {
+        return EraseKey(key, b_array_.GetHash(key));
     }
 
-private:
-    PairType &ForceInsert(const PairType &pair) {
-        auto load_factor = b_array_.LoadFactor();
-        if (load_factor > MAX_LOAD_FACTOR || load_factor < MIN_LOAD_FACTOR) {
-            Reconstruct();
-        }
-        auto [success, ref] = b_array_.Insert(pair);
-        if (!success) {
-            return list_.emplace_back(pair).GetRef();
-        } else {
-            return ref;
+    template<class K>
+    size_t EraseKey(const K &key, size_t hash) {
+        if (Migrating()) {
+            MigrateStep();
+        }
+        size_t index = FindIndex(key, hash);
+        if (index < b_array_.ArraySize()) {
+            b_array_.EraseAt(index);
+            return 1;
+        } else if (index != TableEnd()) {
+            old_array_->EraseAt(index - b_array_.ArraySize());
+            return 1;
+        }
+        if (!stash_.empty()) {
+            auto it = StashFind(key);
+            if (it != stash_.end()) {
+                stash_.erase(it);
+                return 1;
+            }
         }
+        return 0;
     }
 
-    void Reconstruct(bool change_size = true, bool clear = false) {
-        size_t new_size = b_array_.ArraySize() - NEXT + 1;
-        if (change_size) {
-            if (b_array_.LoadFactor() < MIN_LOAD_FACTOR) {
-                new_size /= 2;
+    // Hashes the key and probes the table once, the pair is constructed from args only if the key is absent
+    template<class K, class... Args>
+    std::pair<iterator, bool> FindOrInsert(const K &key, Args &&... args) {
+        return FindOrInsertHashed(key, b_array_.GetHash(key), std::forward<Args>(args)...);
+    }
+
+    template<class K, class... Args>
+    std::pair<iterator, bool> FindOrInsertHashed(const K &key, size_t hash, Args &&... args) {
+        if (Migrating()) {
+            MigrateStep();
+        }
+        if (!stash_.empty()) {
+            auto it = StashFind(key);
+            if (it != stash_.end()) {
+                return {iterator(this, TableEnd(), it), false};
+            }
+        }
+        if (old_array_) {
+            size_t index = old_array_->Find(key, hash);
+            if (index != old_array_->ArraySize()) {
+                return {iterator(this, b_array_.ArraySize() + index, stash_.begin()), false};
+            }
+        }
+        auto [index, found] = b_array_.FindOrPrepareInsert(key, hash);
+        if (found) {
+            return {iterator(this, index, stash_.begin()), false};
+        }
+        if (old_array_ && b_array_.LoadFactor() > resize_policy_.MaxLoadFactor()) {
+            FinishMigration();
+            index = b_array_.PrepareInsert(hash);
+        }
+        if (old_array_ || new_array_) {
+            // the new table was sized for all pairs of the old one, it is not resized until they are migrated
+        } else if (size_t new_size = resize_policy_.NewBucketCount(b_array_.PairsCount(), b_array_.LoadFactor(),
+                                                                   b_array_.BucketCount(), min_bucket_count_)) {
+            if (resize_policy_.Incremental()) {
+                StartMigration(new_size);
             } else {
-                new_size *= 2;
+                Reconstruct(new_size);
+            }
+            index = b_array_.PrepareInsert(hash);
+        }
+        if (index == b_array_.ArraySize()) {
+            return {iterator(this, TableEnd(), stash_.emplace(std::forward<Args>(args)...).first), true};
+        }
+        b_array_.Construct(index, hash, std::forward<Args>(args)...);
+        return {iterator(this, index, stash_.begin()), true};
+    }
+
+    // While an incremental resize is in progress, slot indices past the slots of b_array_
+    // address the slots of old_array_ that are still to be migrated
+    size_t TableEnd() const {
+        return b_array_.ArraySize() + (old_array_ ? old_array_->ArraySize() : 0);
+    }
+
+    size_t NextIndex(size_t index) const {
+        size_t size = b_array_.ArraySize();
+        if (index < size) {
+            index = b_array_.Next(index);
+        }
+        if (index < size || !old_array_) {
+            return index;
+        }
+        return size + old_array_->Next(index - size);
+    }
+
+    PairType &GetRef(size_t index) {
+        return index < b_array_.ArraySize() ? b_array_.GetRef(index) : old_array_->GetRef(index - b_array_.ArraySize());
+    }
+
+    const PairType &GetRef(size_t index) const {
+        return index < b_array_.ArraySize() ? b_array_.GetRef(index) : old_array_->GetRef(index - b_array_.ArraySize());
+    }
+
+    template<class K>
+    size_t FindIndex(const K &key, size_t hash) const {  // TableEnd() if the key is not in the tables
+        size_t index = b_array_.Find(key, hash);
+        if (index != b_array_.ArraySize() || !old_array_) {
+            return index == b_array_.ArraySize() ? TableEnd() : index;
+        }
+        return b_array_.ArraySize() + old_array_->Find(key, hash);
+    }
+
+    // Keys (key_of applied to the elements) are hashed and their home buckets prefetched PREFETCH_DISTANCE
+    // elements ahead of the one passed to f, so the cache misses of that many keys overlap
+    template<class ForwardIt, class KeyOf, class F>
+    void ForEachHashed(ForwardIt first, ForwardIt last, KeyOf key_of, F &&f) const {
+        size_t hashes[hash_map_detail::PREFETCH_DISTANCE];
+        ForwardIt ahead = first;
+        for (size_t i = 0; i < hash_map_detail::PREFETCH_DISTANCE && ahead != last; ++i, ++ahead) {
+            hashes[i] = b_array_.GetHash(key_of(*ahead));
+            b_array_.Prefetch(hashes[i]);
+        }
+        for (size_t i = 0; first != last; ++first, i = (i + 1) % hash_map_detail::PREFETCH_DISTANCE) {
+            f(*first, hashes[i]);
+            if (ahead != last) {
+                hashes[i] = b_array_.GetHash(key_of(*ahead));
+                b_array_.Prefetch(hashes[i]);
+                ++ahead;
+            }
+        }
+    }
+
+    // Zeroing the metadata of a large table takes far longer than an insertion should, so the new table is only
+    // allocated here. Until it is ready, insertions and erasures keep going to b_array_ and zero INIT_STEP buckets each
+    void StartMigration(size_t new_size) {
+        new_array_.emplace(new_size, hash_func_, key_equal_, get_allocator(), true);
+        migrated_ = 0;
+        draining_stash_ = false;
+        MigrateStep();
+    }
+
+    bool Migrating() const {
+        return new_array_ || old_array_ || draining_stash_;
+    }
+
+    // Prepares new_array_ and swaps it in, then moves the pairs of the next MIGRATION_STEP slots of old_array_
+    // to b_array_. Once old_array_ is empty, the stash is drained the same way, MIGRATION_STEP of its buckets at a time
+    void MigrateStep() {
+        if (new_array_) {
+            if (new_array_->InitStep(hash_map_detail::INIT_STEP)) {
+                old_array_ = std::move(b_array_);
+                b_array_ = std::move(*new_array_);
+                new_array_.reset();
+            }
+            return;
+        }
+        if (!old_array_) {
+            DrainStashStep();
+            return;
+        }
+        size_t end = std::min(migrated_ + hash_map_detail::MIGRATION_STEP, old_array_->ArraySize());
+        for (size_t i = old_array_->Next(migrated_); i < end; i = old_array_->Next(i + 1)) {
+            auto &pair = old_array_->GetRef(i);
+            if (b_array_.Insert(hash_map_detail::MoveOut(pair), old_array_->StoredHash(i)) == b_array_.ArraySize()) {
+                stash_.insert(hash_map_detail::MoveOut(pair));
             }
+            old_array_->EraseAt(i);
         }
-        new_size = std::max(new_size, INITIAL_SIZE);
-        BucketArray<KeyType, ValueType, Hash> tmp_map(new_size, hash_func_);
-        ListType tmp_list;
-        if (!clear) {
-            for (const auto &bucket: *this) {
-                if (!tmp_map.Insert(bucket).first) {
-                    tmp_list.emplace_back(bucket);
+        migrated_ = end;
+        if (migrated_ == old_array_->ArraySize()) {
+            old_array_.reset();
+            migrated_ = 0;
+            stash_buckets_ = stash_.bucket_count();
+            draining_stash_ = !stash_.empty();
+        }
+    }
+
+    // Pairs that fit into the larger table leave the stash, the rest stay. A rehash of the stash between steps
+    // reorders its buckets, the drain then starts over
+    void DrainStashStep() {
+        if (stash_.bucket_count() != stash_buckets_) {
+            migrated_ = 0;
+            stash_buckets_ = stash_.bucket_count();
+        }
+        size_t end = std::min(migrated_ + hash_map_detail::MIGRATION_STEP, stash_buckets_);
+        for (; migrated_ < end; ++migrated_) {
+            for (auto local = stash_.begin(migrated_); local != stash_.end(migrated_);) {
+                auto it = stash_.find(local->first);  // the same pair, erasing it leaves local valid
+                ++local;
+                if (b_array_.Insert(hash_map_detail::MoveOut(*it)) != b_array_.ArraySize()) {
+                    stash_.erase(it);
                 }
             }
         }
-        b_array_ = tmp_map;
-        list_ = tmp_list;
+        draining_stash_ = migrated_ != stash_buckets_;
+    }
+
+    void FinishMigration() {
+        while (Migrating()) {
+            MigrateStep();
+        }
+    }
+
+    void Reset() {  // the state of a new map with INITIAL_SIZE buckets, the hash, key_equal and policy are kept
+        min_bucket_count_ = INITIAL_SIZE;
+        b_array_ = BArray(INITIAL_SIZE, hash_func_, key_equal_, get_allocator());
+        new_array_.reset();
+        old_array_.reset();
+        migrated_ = 0;
+        draining_stash_ = false;
+        stash_buckets_ = 0;
+        stash_.clear();
+    }
+
+    void Reconstruct(size_t new_size) {  // moves every pair into a table with new_size buckets
+        new_array_.reset();
+        FinishMigration();
+        StashType tmp_stash(0, hash_func_, key_equal_, get_allocator());
+        if (!GrowInPlace(new_size, tmp_stash)) {
+            BArray tmp_map(new_size, hash_func_, key_equal_, get_allocator());
+            tmp_map.MoveFrom(b_array_, resize_policy_.Threads(), [&tmp_stash](PairType &pair) {
+                tmp_stash.insert(hash_map_detail::MoveOut(pair));
+            });
+            // The old storage is released together with tmp_map, so a resize never holds more than two tables
+            b_array_ = std::move(tmp_map);
+        }
+        while (!stash_.empty()) {
+            auto node = stash_.extract(stash_.begin());
+            if (b_array_.Insert(std::pair<KeyType &&, ValueType &&>(std::move(node.key()), std::move(node.mapped())))
+                == b_array_.ArraySize()) {
+                tmp_stash.insert(std::move(node));
+            }
+        }
+        stash_ = std::move(tmp_stash);
+    }
+
+    bool GrowInPlace(size_t new_size, StashType &overflow) {  // false if the table has to be rebuilt into a new one
+        if constexpr (BArray::GROWS_IN_PLACE) {
+            if (resize_policy_.InPlace() && (size_t(1) << hash_map_detail::Log2(new_size)) == b_array_.BucketCount() * 2) {
+                b_array_.Grow([&overflow](auto &&pair) {
+                    overflow.insert(std::move(pair));
+                });
+                return true;
+            }
+        }
+        return false;
     }
 
     Hash hash_func_;
-    BucketArray<KeyType, ValueType, Hash> b_array_;
-    ListType list_;
+    KeyEqual key_equal_;
+    ResizePolicy resize_policy_;
+    size_t min_bucket_count_;
+    BArray b_array_;
+    std::optional<BArray> new_array_;  // the table an incremental resize moves to, while its metadata is being zeroed
+    std::optional<BArray> old_array_;  // the table being migrated during an incremental resize
+    size_t migrated_ = 0;  // slots of old_array_, then buckets of stash_, already migrated
+    bool draining_stash_ = false;
+    size_t stash_buckets_ = 0;  // the bucket count of stash_ when the drain started
+    StashType stash_;
 };
+
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+        class Allocator = std::allocator<std::pair<const KeyType, ValueType>>, class Policy = TablePolicy<>>
+using SwissHashMap = HashMap<KeyType, ValueType, Hash, KeyEqual, Allocator, Policy, SwissBucketArray>;
+
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+        class Policy = TablePolicy<>>
+using HugePageHashMap = HashMap<KeyType, ValueType, Hash, KeyEqual, HugePageAllocator<std::pair<const KeyType, ValueType>>, Policy>;
+
+namespace pmr {  // maps that allocate from a std::pmr::memory_resource
+    template<class KeyType, class ValueType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+            class Policy = TablePolicy<>>
+    using HashMap = ::HashMap<KeyType, ValueType, Hash, KeyEqual,
+            std::pmr::polymorphic_allocator<std::pair<const KeyType, ValueType>>, Policy>;
+
+    template<class KeyType, class ValueType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+            class Policy = TablePolicy<>>
+    using SwissHashMap = ::SwissHashMap<KeyType, ValueType, Hash, KeyEqual,
+            std::pmr::polymorphic_allocator<std::pair<const KeyType, ValueType>>, Policy>;
+}